@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "fmt/format.h"
+
+#include "generator.hpp"
+#include "linalg.hpp"
+#include "model.hpp"
+#include "solver.hpp"
+#include "types.hpp"
+
+// Barnes-Hut force error against exact direct summation, swept over theta.
+//
+// Usage: accuracy-benchmark [count] [epsilon] [seed] [theta...]
+//
+// Prints one JSON object per line, so the output can be appended to a file
+// and compared across releases. The same seed gives the same bodies.
+
+namespace bh {
+
+struct accuracy_result {
+    real rms_error;
+    real p99_error;
+    real max_error;
+};
+
+using benchmark_clock = std::chrono::steady_clock;
+
+static real elapsed_ns(benchmark_clock::time_point begin)
+{
+    return std::chrono::duration<real, std::nano>(benchmark_clock::now() - begin).count();
+}
+
+static accuracy_result compare(const array<vec2>& approximate, const array<vec2>& exact)
+{
+    array<real> errors(exact.size());
+
+    for (u32 i = 0; i < exact.size(); ++i) {
+        errors[i] = (approximate[i] - exact[i]).len() / exact[i].len();
+    }
+
+    real sum = 0.0_r;
+    for (real error : errors) {
+        sum += error * error;
+    }
+
+    accuracy_result result { .rms_error = std::sqrt(sum / errors.size()), .p99_error = 0.0_r, .max_error = 0.0_r };
+
+    auto p99 = errors.begin() + static_cast<size_t>(0.99_r * (errors.size() - 1));
+    std::nth_element(errors.begin(), p99, errors.end());
+    result.p99_error = *p99;
+    result.max_error = *std::max_element(p99, errors.end());
+
+    return result;
+}
+
+static solver_params make_params(real theta, real epsilon)
+{
+    return solver_params { .t                  = 1.0_r,
+                           .dt                 = 0.001_r,
+                           .theta              = theta,
+                           .epsilon            = epsilon,
+                           .accuracy_parameter = 0.1_r,
+                           .adaptive_timestep  = false,
+                           .direct_threshold   = 0,
+                           .direct_threads     = std::max(std::thread::hardware_concurrency(), 1u) };
+}
+
+static void run_direct(const particle_array& model, u32 seed, real epsilon)
+{
+    particle_array points      = model;
+    particle_array points_copy = model;
+
+    solver_params params = make_params(0.0_r, epsilon);
+    params.direct_threads = 1;
+    solver nbody_solver(params, points, points_copy);
+
+    auto begin = benchmark_clock::now();
+    nbody_solver.exact_accelerations(0, points.size());
+    real force_ns = elapsed_ns(begin);
+
+    fmt::print(
+        "{{\"engine\": \"direct\", \"count\": {}, \"seed\": {}, \"epsilon\": {}, \"interactions_per_body\": {}, "
+        "\"ns_per_body\": {:.1f}}}\n",
+        points.size(),
+        seed,
+        epsilon,
+        points.size() - 1,
+        force_ns / points.size());
+}
+
+static void run_tree(const particle_array& model, u32 seed, real theta, real epsilon)
+{
+    particle_array points      = model;
+    particle_array points_copy = model;
+
+    solver nbody_solver(make_params(theta, epsilon), points, points_copy);
+
+    auto build_begin = benchmark_clock::now();
+    nbody_solver.rebuild_tree();
+    real build_ns = elapsed_ns(build_begin);
+
+    array<vec2> approximate(points.size());
+
+    auto force_begin = benchmark_clock::now();
+    for (u32 i = 0; i < points.size(); ++i) {
+        approximate[i] = nbody_solver.tree_acceleration(i);
+    }
+    real force_ns = elapsed_ns(force_begin);
+
+    // Counted in a separate pass to keep the timing above clean
+    body_stats stats;
+    for (u32 i = 0; i < points.size(); ++i) {
+        nbody_solver.tree_acceleration(i, &stats);
+    }
+
+    // Same ordering as the tree left the points in
+    accuracy_result accuracy = compare(approximate, nbody_solver.exact_accelerations(0, points.size()));
+
+    real count = points.size();
+
+    fmt::print(
+        "{{\"engine\": \"tree\", \"count\": {}, \"seed\": {}, \"epsilon\": {}, \"theta\": {}, "
+        "\"rms_relative_error\": {:.6e}, \"p99_relative_error\": {:.6e}, \"max_relative_error\": {:.6e}, "
+        "\"interactions_per_body\": {:.2f}, \"node_interactions_per_body\": {:.2f}, "
+        "\"point_interactions_per_body\": {:.2f}, \"opened_cells_per_body\": {:.2f}, "
+        "\"build_ns_per_body\": {:.1f}, \"force_ns_per_body\": {:.1f}, \"ns_per_body\": {:.1f}}}\n",
+        points.size(),
+        seed,
+        epsilon,
+        theta,
+        accuracy.rms_error,
+        accuracy.p99_error,
+        accuracy.max_error,
+        (stats.node_interactions + stats.point_interactions) / count,
+        stats.node_interactions / count,
+        stats.point_interactions / count,
+        stats.opened_cells / count,
+        build_ns / count,
+        force_ns / count,
+        (build_ns + force_ns) / count);
+}
+
+}
+
+using namespace bh;
+
+int main(int argc, char** argv)
+{
+    u32 count    = argc > 1 ? std::stoul(argv[1]) : 10000;
+    real epsilon = argc > 2 ? std::stod(argv[2]) : 1e-4_r;
+    u32 seed     = argc > 3 ? std::stoul(argv[3]) : 42;
+
+    array<real> thetas;
+    for (int arg = 4; arg < argc; ++arg) {
+        thetas.push_back(std::stod(argv[arg]));
+    }
+    if (thetas.empty()) {
+        thetas = { 0.1_r, 0.2_r, 0.3_r, 0.5_r, 0.7_r, 1.0_r };
+    }
+
+    particle_array model
+        = generator { generator_params { .count = count, .scale_factor = 0.589_r, .seed = seed } }.generate();
+
+    run_direct(model, seed, epsilon);
+
+    for (real theta : thetas) {
+        run_tree(model, seed, theta, epsilon);
+    }
+
+    return 0;
+}
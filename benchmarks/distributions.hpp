@@ -0,0 +1,60 @@
+#pragma once
+
+#include <random>
+
+#include "generator.hpp"
+#include "model.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+enum class distribution : u32 {
+    uniform   = 0,
+    plummer   = 1,
+    clustered = 2,
+};
+
+inline const char* distribution_name(distribution dist)
+{
+    switch (dist) {
+    case distribution::uniform:
+        return "uniform";
+    case distribution::plummer:
+        return "plummer";
+    case distribution::clustered:
+        return "clustered";
+    }
+    return "unknown";
+}
+
+// Deterministic model of `count` bodies for benchmarks
+inline particle_array make_points(distribution dist, u32 count)
+{
+    if (dist == distribution::plummer) {
+        return generator { generator_params { .count = count, .scale_factor = 0.589_r, .seed = 42 } }.generate();
+    }
+
+    std::mt19937 rand_engine(42);
+    std::uniform_real_distribution<real> uniform(-1.0_r, 1.0_r);
+    std::normal_distribution<real> normal(0.0_r, 0.01_r);
+
+    array<vec2> centers(16);
+    for (vec2& center : centers) {
+        center = vec2 { uniform(rand_engine), uniform(rand_engine) };
+    }
+
+    particle_array points(count);
+    for (u32 i = 0; i < count; ++i) {
+        vec2 position;
+        if (dist == distribution::uniform) {
+            position = vec2 { uniform(rand_engine), uniform(rand_engine) };
+        } else {
+            position = centers[i % centers.size()] + vec2 { normal(rand_engine), normal(rand_engine) };
+        }
+        points[i] = point_t { .position = position, .velocity = vec2 { 0.0_r, 0.0_r }, .mass = 1.0_r / count };
+    }
+
+    return points;
+}
+
+}
@@ -0,0 +1,158 @@
+#include <benchmark/benchmark.h>
+
+#include "ev_loop.hpp"
+#include "future.hpp"
+#include "thread_pool.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+// Push n tasks up front, then drain them
+static void BM_EvLoopPushDispatch(benchmark::State& state)
+{
+    const u32 tasks = state.range(0);
+
+    for (auto _ : state) {
+        startEvLoop([tasks](unit) -> unit {
+            for (u32 i = 0; i < tasks; ++i) {
+                pushToEvLoop<unit>([](unit) -> unit { return unit(); });
+            }
+            pushToEvLoop<unit>([](unit) -> unit {
+                stopEvLoop();
+                return unit();
+            });
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasks);
+}
+BENCHMARK(BM_EvLoopPushDispatch)->Range(1 << 6, 1 << 14);
+
+// Same without futures
+static void BM_EvLoopPostDispatch(benchmark::State& state)
+{
+    const u32 tasks = state.range(0);
+
+    for (auto _ : state) {
+        startEvLoop([tasks](unit) -> unit {
+            for (u32 i = 0; i < tasks; ++i) {
+                postToEvLoop([](unit) -> unit { return unit(); });
+            }
+            postToEvLoop([](unit) -> unit {
+                stopEvLoop();
+                return unit();
+            });
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasks);
+}
+BENCHMARK(BM_EvLoopPostDispatch)->Range(1 << 6, 1 << 14);
+
+static void chain(u32 counter)
+{
+    if (counter == 0) {
+        stopEvLoop();
+        return;
+    }
+    pushToEvLoop<unit>([counter](unit) -> unit {
+        chain(counter - 1);
+        return unit();
+    });
+}
+
+// Every task pushes its successor, the pattern of the transport polling loop
+static void BM_EvLoopChain(benchmark::State& state)
+{
+    const u32 tasks = state.range(0);
+
+    for (auto _ : state) {
+        startEvLoop([tasks](unit) -> unit {
+            chain(tasks);
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasks);
+}
+BENCHMARK(BM_EvLoopChain)->Range(1 << 6, 1 << 14);
+
+static void post_chain(u32 counter)
+{
+    if (counter == 0) {
+        stopEvLoop();
+        return;
+    }
+    postToEvLoop([counter](unit) -> unit {
+        post_chain(counter - 1);
+        return unit();
+    });
+}
+
+static void BM_EvLoopPostChain(benchmark::State& state)
+{
+    const u32 tasks = state.range(0);
+
+    for (auto _ : state) {
+        startEvLoop([tasks](unit) -> unit {
+            post_chain(tasks);
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasks);
+}
+BENCHMARK(BM_EvLoopPostChain)->Range(1 << 6, 1 << 14);
+
+// Fan n tasks out to the pool and back to the loop
+static void BM_ThreadPoolOffload(benchmark::State& state)
+{
+    const u32 tasks = state.range(0);
+    thread_pool pool;
+
+    for (auto _ : state) {
+        startEvLoop([tasks, &pool](unit) -> unit {
+            for (u32 i = 0; i < tasks; ++i) {
+                future<unit> fut = g_event_loop.offload<u32>(pool, [i](unit) -> u32 { return i; })
+                                       .then<unit>([](u32 value) -> unit {
+                                           benchmark::DoNotOptimize(value);
+                                           return unit();
+                                       });
+            }
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasks);
+}
+BENCHMARK(BM_ThreadPoolOffload)->Range(1 << 6, 1 << 14);
+
+static void BM_FuturePromiceCreate(benchmark::State& state)
+{
+    for (auto _ : state) {
+        auto [fut, prom] = create_futue_promice_pair<u32>();
+        benchmark::DoNotOptimize(fut.resolved());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FuturePromiceCreate);
+
+static void BM_FutureThenResolve(benchmark::State& state)
+{
+    for (auto _ : state) {
+        auto [fut, prom] = create_futue_promice_pair<u32>();
+        future<u32> next = fut.then<u32>([](u32 value) -> u32 { return value + 1; });
+        prom.resolve(41);
+        benchmark::DoNotOptimize(next.get());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FutureThenResolve);
+
+}
+
+BENCHMARK_MAIN();
@@ -0,0 +1,80 @@
+#include <benchmark/benchmark.h>
+
+#include "distributions.hpp"
+#include "model.hpp"
+#include "tree.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+using benchmark_quadtree = quadtree<point_t, node_t, particle_array>;
+
+static void BM_QuadtreeBuild(benchmark::State& state)
+{
+    distribution dist     = static_cast<distribution>(state.range(1));
+    particle_array points = make_points(dist, state.range(0));
+
+    for (auto _ : state) {
+        benchmark_quadtree tree = benchmark_quadtree::build(points);
+        benchmark::DoNotOptimize(tree.node_count());
+    }
+
+    state.SetLabel(distribution_name(dist));
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_QuadtreeBuild)->ArgsProduct({ benchmark::CreateRange(1 << 10, 1 << 18, 8), { 0, 1, 2 } });
+
+static void BM_QuadtreeRebuild(benchmark::State& state)
+{
+    distribution dist     = static_cast<distribution>(state.range(1));
+    particle_array points = make_points(dist, state.range(0));
+
+    benchmark_quadtree tree = benchmark_quadtree::build(points);
+
+    for (auto _ : state) {
+        benchmark_quadtree::rebuild(tree);
+        benchmark::DoNotOptimize(tree.node_count());
+    }
+
+    state.SetLabel(distribution_name(dist));
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_QuadtreeRebuild)->ArgsProduct({ benchmark::CreateRange(1 << 10, 1 << 18, 8), { 0, 1, 2 } });
+
+// One opening-criterion traversal per body for a fixed sample of bodies
+static void BM_QuadtreeReduce(benchmark::State& state)
+{
+    distribution dist     = static_cast<distribution>(state.range(1));
+    particle_array points = make_points(dist, state.range(0));
+    const real theta      = 0.5_r;
+    const u32 sample      = std::min<u32>(points.size(), 1024);
+
+    benchmark_quadtree tree = benchmark_quadtree::build(points);
+    tree.walk_leafs([](node_t& node, point_t& point) { node.mass += point.mass; });
+    tree.walk_nodes([](node_t& parent, node_t& child) { parent.mass += child.mass; });
+
+    for (auto _ : state) {
+        real mass = 0.0_r;
+
+        for (u32 i = 0; i < sample; ++i) {
+            vec2 position = points[i].position;
+
+            tree.reduce(
+                [&mass](const node_t& node) { mass += node.mass; },
+                [&mass](const point_t& point) { mass += point.mass; },
+                [position, theta](benchmark_quadtree::axis_aligned_bounding_box aabb) -> bool {
+                    return (aabb.max - aabb.min).len() / (position - (aabb.max + aabb.min) / 2.0).len() < theta;
+                });
+        }
+
+        benchmark::DoNotOptimize(mass);
+    }
+
+    state.SetLabel(distribution_name(dist));
+    state.SetItemsProcessed(state.iterations() * sample);
+}
+BENCHMARK(BM_QuadtreeReduce)->ArgsProduct({ benchmark::CreateRange(1 << 10, 1 << 18, 8), { 0, 1, 2 } });
+
+}
+
+BENCHMARK_MAIN();
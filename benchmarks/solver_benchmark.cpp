@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+#include <limits>
+
+#include "distributions.hpp"
+#include "model.hpp"
+#include "solver.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+static solver_params benchmark_params(u32 direct_threshold)
+{
+    return solver_params { .t                  = 1.0_r,
+                           .dt                 = 0.001_r,
+                           .theta              = 0.5_r,
+                           .epsilon            = 1e-4_r,
+                           .accuracy_parameter = 0.1_r,
+                           .adaptive_timestep  = false,
+                           .direct_threshold   = direct_threshold,
+                           .direct_threads     = 1 };
+}
+
+static void BM_SolverRebuildTree(benchmark::State& state)
+{
+    distribution dist          = static_cast<distribution>(state.range(1));
+    particle_array points      = make_points(dist, state.range(0));
+    particle_array points_copy = points;
+
+    solver nbody_solver(benchmark_params(0), points, points_copy);
+
+    for (auto _ : state) {
+        nbody_solver.rebuild_tree();
+    }
+
+    state.SetLabel(distribution_name(dist));
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_SolverRebuildTree)->ArgsProduct({ benchmark::CreateRange(1 << 10, 1 << 16, 4), { 0, 1, 2 } });
+
+static void BM_SolverStep(benchmark::State& state)
+{
+    distribution dist          = static_cast<distribution>(state.range(1));
+    particle_array points      = make_points(dist, state.range(0));
+    particle_array points_copy = points;
+
+    solver nbody_solver(benchmark_params(0), points, points_copy);
+    nbody_solver.rebuild_tree();
+
+    for (auto _ : state) {
+        nbody_solver.step(0, points.size());
+    }
+
+    state.SetLabel(distribution_name(dist));
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_SolverStep)
+    ->ArgsProduct({ benchmark::CreateRange(1 << 10, 1 << 14, 4), { 0, 1, 2 } })
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_SolverDirectStep(benchmark::State& state)
+{
+    particle_array points      = make_points(distribution::plummer, state.range(0));
+    particle_array points_copy = points;
+
+    solver nbody_solver(benchmark_params(std::numeric_limits<u32>::max()), points, points_copy);
+
+    for (auto _ : state) {
+        nbody_solver.step(0, points.size());
+    }
+
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_SolverDirectStep)->Range(1 << 8, 1 << 13)->Unit(benchmark::kMillisecond);
+
+}
+
+BENCHMARK_MAIN();
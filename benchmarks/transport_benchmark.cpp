@@ -0,0 +1,195 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+
+#include "cluster.hpp"
+#include "ev_loop.hpp"
+#include "transport.hpp"
+#include "transport_backend.hpp"
+#include "types.hpp"
+
+// Message round trips between rank 0 and an echo server on rank 1.
+//
+// Usage: mpirun -n 2 transport-benchmark
+//        transport-benchmark shm
+
+namespace bh {
+
+enum class benchmark_message_type : u32 {
+    payload = 100,
+};
+
+struct payload {
+    u64 sequence;
+    real values[4];
+};
+
+struct payload_message {
+    static constexpr benchmark_message_type msg_type = benchmark_message_type::payload;
+
+    payload payload_;
+
+    void parce(const void* buffer)
+    {
+        payload_ = *reinterpret_cast<const payload*>(buffer);
+    }
+
+    size_t size()
+    {
+        return sizeof(payload);
+    }
+
+    void serialize(void* buffer)
+    {
+        *reinterpret_cast<payload*>(buffer) = payload_;
+    }
+};
+
+// Same wire format, sent and received without a staging buffer
+struct zero_copy_payload_message : payload_message {
+    static constexpr bool zero_copy = true;
+};
+
+static cluster_transport* g_transport = nullptr;
+
+constexpr u32 echo_node  = 1;
+constexpr u32 payload_id = std::to_underlying(benchmark_message_type::payload);
+
+static void BM_TransportArrayRoundTrip(benchmark::State& state)
+{
+    array<std::byte> buffer(state.range(0));
+
+    for (auto _ : state) {
+        g_transport->send_array<std::byte>(buffer, echo_node, payload_id);
+        g_transport->receive_array<std::byte>(buffer.begin(), buffer.end(), echo_node, payload_id);
+    }
+
+    state.SetBytesProcessed(2 * state.iterations() * buffer.size());
+}
+BENCHMARK(BM_TransportArrayRoundTrip)->Range(8, 8 << 20);
+
+// send_message out, reply picked up by a handler polled from the event loop
+template <typename Message>
+static void BM_TransportMessageRoundTrip(benchmark::State& state)
+{
+    u64 sequence = 0;
+
+    for (auto _ : state) {
+        startEvLoop([&sequence](unit) -> unit {
+            Message msg {};
+            msg.payload_ = payload { .sequence = sequence, .values = {} };
+            g_transport->send_message<Message>(echo_node, msg);
+
+            g_transport->add_handler<Message>(
+                echo_node,
+                [&sequence](Message msg) -> unit {
+                    sequence = msg.payload_.sequence + 1;
+                    stopEvLoop();
+                    return unit();
+                },
+                Message {});
+
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_TransportMessageRoundTrip, payload_message);
+BENCHMARK_TEMPLATE(BM_TransportMessageRoundTrip, zero_copy_payload_message);
+
+// A burst of small messages, each sent on its own or all of them in one batch. Replies
+// come back the way the requests went.
+template <bool Batched>
+static void BM_TransportMessageBurst(benchmark::State& state)
+{
+    u32 burst   = state.range(0);
+    u32 replies = 0;
+
+    for (auto _ : state) {
+        startEvLoop([&](unit) -> unit {
+            replies = 0;
+
+            for (u32 i = 0; i < burst; ++i) {
+                zero_copy_payload_message msg {};
+                msg.payload_ = payload { .sequence = i, .values = {} };
+
+                if constexpr (Batched) {
+                    g_transport->post_message<zero_copy_payload_message>(echo_node, msg);
+                } else {
+                    g_transport->send_message<zero_copy_payload_message>(echo_node, msg);
+                }
+
+                g_transport->add_handler<zero_copy_payload_message>(
+                    echo_node,
+                    [&replies, burst](zero_copy_payload_message) -> unit {
+                        if (++replies == burst) {
+                            stopEvLoop();
+                        }
+                        return unit();
+                    },
+                    zero_copy_payload_message {});
+            }
+
+            if constexpr (Batched) {
+                g_transport->flush();
+            }
+
+            return unit();
+        });
+    }
+
+    state.SetItemsProcessed(state.iterations() * burst);
+}
+BENCHMARK_TEMPLATE(BM_TransportMessageBurst, false)->RangeMultiplier(4)->Range(2, 32);
+BENCHMARK_TEMPLATE(BM_TransportMessageBurst, true)->RangeMultiplier(4)->Range(2, 32);
+
+// Echoes every message back with its type, batches included, until an empty one arrives
+static void serve_echo(cluster_transport& transport, u32 peer)
+{
+    while (true) {
+        u32 node;
+        u32 type;
+        if (!transport.probe(node, type) || node != peer) {
+            continue;
+        }
+
+        array<std::byte> buffer = transport.receive_array<std::byte>(peer, type);
+        if (buffer.empty()) {
+            return;
+        }
+        transport.send_array<std::byte>(buffer, peer, type);
+    }
+}
+
+}
+
+using namespace bh;
+
+int main(int argc, char** argv)
+{
+    // Two forked processes talking through shared memory instead of MPI
+    bool shm = argc > 1 && std::strcmp(argv[1], "shm") == 0;
+
+    cluster_transport transport(shm ? launch_shm_backend(2, 1 << 20) : make_mpi_backend(argc, argv));
+    node this_node(transport.rank(), transport.ranks());
+
+    if (this_node.nodes_count() < 2) {
+        LOG_ERROR("transport-benchmark needs at least two ranks");
+        return 1;
+    }
+
+    if (this_node.node_index() == echo_node) {
+        serve_echo(transport, 0);
+    } else if (this_node.node_index() == 0) {
+        g_transport = &transport;
+
+        benchmark::Initialize(&argc, argv);
+        benchmark::RunSpecifiedBenchmarks();
+        benchmark::Shutdown();
+
+        transport.send_array<std::byte>(array<std::byte> {}, echo_node, payload_id);
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <benchmark/benchmark.h>
+
+#include "linalg.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+static array<vec2> make_vectors(u32 count)
+{
+    array<vec2> vectors(count);
+    for (u32 i = 0; i < count; ++i) {
+        vectors[i] = vec2 { 0.5_r + i, 1.5_r - i };
+    }
+    return vectors;
+}
+
+static void BM_VectorAdd(benchmark::State& state)
+{
+    array<vec2> vectors = make_vectors(state.range(0));
+
+    for (auto _ : state) {
+        vec2 sum { 0.0_r, 0.0_r };
+        for (const vec2& v : vectors) {
+            sum = sum + v;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetItemsProcessed(state.iterations() * vectors.size());
+}
+BENCHMARK(BM_VectorAdd)->Range(1 << 8, 1 << 16);
+
+static void BM_VectorDot(benchmark::State& state)
+{
+    array<vec2> vectors = make_vectors(state.range(0));
+
+    for (auto _ : state) {
+        real sum = 0.0_r;
+        for (const vec2& v : vectors) {
+            sum += vec2::dot(v, v);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetItemsProcessed(state.iterations() * vectors.size());
+}
+BENCHMARK(BM_VectorDot)->Range(1 << 8, 1 << 16);
+
+static void BM_VectorLen(benchmark::State& state)
+{
+    array<vec2> vectors = make_vectors(state.range(0));
+
+    for (auto _ : state) {
+        real sum = 0.0_r;
+        for (const vec2& v : vectors) {
+            sum += v.len();
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.SetItemsProcessed(state.iterations() * vectors.size());
+}
+BENCHMARK(BM_VectorLen)->Range(1 << 8, 1 << 16);
+
+static void BM_VectorNorm(benchmark::State& state)
+{
+    array<vec2> vectors = make_vectors(state.range(0));
+
+    for (auto _ : state) {
+        for (vec2& v : vectors) {
+            v = v.norm();
+        }
+        benchmark::DoNotOptimize(vectors.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * vectors.size());
+}
+BENCHMARK(BM_VectorNorm)->Range(1 << 8, 1 << 16);
+
+}
+
+BENCHMARK_MAIN();
@@ -1,6 +1,7 @@
 #include "frontend.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <raylib.h>
 #include <utility>
 
@@ -10,9 +11,27 @@
 #include "logging.hpp"
 #include "messages.hpp"
 #include "model.hpp"
+#include "tracing.hpp"
 
 namespace bh {
 
+const char* telemetry_name(telemetry series) noexcept
+{
+    switch (series) {
+    case telemetry::energy:
+        return "energy";
+    case telemetry::momentum:
+        return "momentum";
+    case telemetry::dt:
+        return "dt";
+    case telemetry::step_time:
+        return "step time";
+    case telemetry::load_imbalance:
+        return "load imbalance";
+    }
+    return "unknown";
+}
+
 frontend::frontend(node& node, cluster_transport& transport)
     : node_(node)
     , transport_(transport)
@@ -28,6 +47,7 @@ void frontend::start()
     bool enable_frontend    = config["frontend"]["enable"].as<bool>();
     frontend_refresh_every_ = config["frontend"]["refresh_every"].as<u32>();
     draw_energy_            = config["frontend"]["draw_energy"].as<bool>();
+    tracing_                = config["diagnostics"]["tracing"].as<bool>();
 
     if (!enable_frontend) {
         LOG_INFO("Frontend disabled. Do not starting frontend.");
@@ -36,6 +56,10 @@ void frontend::start()
 
     LOG_INFO("Starting frontend application...");
 
+    if (tracing_) {
+        enable_tracing(node_.node_index(), "frontend");
+    }
+
     startEvLoop([this](unit) -> unit {
         setup();
 
@@ -47,14 +71,18 @@ void frontend::start()
 
 void frontend::setup()
 {
-    points_ = transport_.receive_array<point_t>(
-        node_.master_node_index(), std::to_underlying(cluster_message_type::points));
-
     InitWindow(screen_size_[0], screen_size_[1], "Simulation");
     SetTargetFPS(0);
 
-    transport_.add_handler<points_message>(
-        node_.master_node_index(), [](points_message) -> unit { return unit(); }, points_message { points_ }, true);
+    // Acknowledged right away, the master sends at most one frame at a time
+    transport_.add_handler<positions_message>(
+        node_.master_node_index(),
+        [this](positions_message) -> unit {
+            transport_.send_message<frame_ack_message>(node_.master_node_index(), frame_ack_message {});
+            return unit();
+        },
+        positions_message { positions_ },
+        true);
 
     transport_.add_handler<stop_message>(
         node_.master_node_index(),
@@ -69,10 +97,10 @@ void frontend::setup()
         node_.master_node_index(),
         [this](status_message msg) -> unit {
             done_persent_ = msg.status_.done_persent;
-            energy_vec_.push_back(msg.status_.energy);
+            record(msg.status_);
             return unit();
         },
-        status_message { status { .done_persent = 0.0_r, .energy = 0.0_r } },
+        status_message { status {} },
         true);
 
     loop();
@@ -80,6 +108,8 @@ void frontend::setup()
 
 void frontend::draw()
 {
+    TRACE_SCOPE("draw");
+
     scale_factor_ += GetMouseWheelMove();
     if (scale_factor_ < 0) {
         scale_factor_ = 0;
@@ -92,34 +122,70 @@ void frontend::draw()
     DrawText(TextFormat("%i frames per second", GetFPS()), 0, 0, 20, WHITE);
     DrawText(TextFormat("%02.02f percent done", done_persent_), 0, 25, 20, WHITE);
 
-    if (draw_energy_ && !energy_vec_.empty()) {
-        real max = *std::max_element(energy_vec_.begin(), energy_vec_.end());
-        real min = *std::min_element(energy_vec_.begin(), energy_vec_.end());
-
-        DrawText(TextFormat("%02.02f", max), screen_size_[0] - 20 * 4, 0, 20, RED);
-        DrawText(TextFormat("%02.02f", min), screen_size_[0] - 20 * 4, screen_size_[1] - 20, 20, RED);
-
-        for (size_t i = 0; i < energy_vec_.size() - 1; ++i) {
-            DrawLine(
-                (float)i / energy_vec_.size() * screen_size_[0],
-                screen_size_[1] - (energy_vec_[i] - min) / (max - min) * screen_size_[1],
-                (float)(i + 1) / energy_vec_.size() * screen_size_[0],
-                screen_size_[1] - (energy_vec_[i + 1] - min) / (max - min) * screen_size_[1],
-                RED);
-        }
+    if (IsKeyPressed(KEY_TAB)) {
+        plotted_ = static_cast<telemetry>((std::to_underlying(plotted_) + 1) % telemetry_count);
     }
 
-    for (point_t& point : points_) {
-        vec2 position = space_to_screen(point.position);
+    draw_plot(plotted_);
+
+    for (vec2 body : positions_) {
+        vec2 position = space_to_screen(body);
         DrawPixel(position[0], position[1], BLUE);
     }
 
     EndDrawing();
 }
 
+void frontend::record(const status& status)
+{
+    // NaN until the master has a first sum
+    if (draw_energy_ && !std::isnan(status.energy)) {
+        telemetry_[std::to_underlying(telemetry::energy)].push(status.energy);
+    }
+    telemetry_[std::to_underlying(telemetry::momentum)].push(status.momentum);
+    telemetry_[std::to_underlying(telemetry::dt)].push(status.dt);
+    telemetry_[std::to_underlying(telemetry::step_time)].push(status.step_time);
+    if (status.load_imbalance > 0.0_r) {
+        telemetry_[std::to_underlying(telemetry::load_imbalance)].push(status.load_imbalance);
+    }
+}
+
+// Mean line with the min-max envelope of every bucket, at most plot_resolution buckets per frame
+void frontend::draw_plot(telemetry series)
+{
+    const time_series<plot_resolution>& values = telemetry_[std::to_underlying(series)];
+
+    DrawText(TextFormat("%s (tab to switch)", telemetry_name(series)), 0, screen_size_[1] - 20, 20, RED);
+
+    if (values.empty()) {
+        return;
+    }
+
+    real max   = values.max();
+    real min   = values.min();
+    real range = max > min ? max - min : 1.0_r;
+
+    DrawText(TextFormat("%g", max), screen_size_[0] - 20 * 5, 0, 20, RED);
+    DrawText(TextFormat("%g", min), screen_size_[0] - 20 * 5, screen_size_[1] - 20, 20, RED);
+    DrawText(TextFormat("%g", values.last()), screen_size_[0] - 20 * 5, 25, 20, WHITE);
+
+    auto x = [this, &values](u32 i) -> int { return (real)i / values.size() * screen_size_[0]; };
+    auto y = [this, min, range](real value) -> int {
+        return screen_size_[1] - (value - min) / range * screen_size_[1];
+    };
+
+    for (u32 i = 0; i < values.size(); ++i) {
+        DrawLine(x(i), y(values[i].min), x(i), y(values[i].max), MAROON);
+
+        if (i + 1 < values.size()) {
+            DrawLine(x(i), y(values[i].mean()), x(i + 1), y(values[i + 1].mean()), RED);
+        }
+    }
+}
+
 void frontend::loop()
 {
-    pushToEvLoop<unit>([this](unit) -> unit {
+    postToEvLoop([this](unit) -> unit {
         draw();
         loop();
 
@@ -130,6 +196,16 @@ void frontend::loop()
 void frontend::stop()
 {
     CloseWindow();
+
+    if (tracing_) {
+        std::string events = trace_events_json();
+
+        transport_.send_array<char>(
+            array<char>(events.begin(), events.end()),
+            node_.master_node_index(),
+            std::to_underlying(cluster_message_type::trace));
+    }
+
     stopEvLoop();
 }
 
@@ -4,12 +4,26 @@
 
 #include "cluster.hpp"
 #include "linalg.hpp"
+#include "messages.hpp"
 #include "model.hpp"
 #include "solver.hpp"
+#include "time_series.hpp"
 #include "transport.hpp"
 
 namespace bh {
 
+enum class telemetry : u32 {
+    energy         = 0,
+    momentum       = 1,
+    dt             = 2,
+    step_time      = 3,
+    load_imbalance = 4,
+};
+
+static constexpr u32 telemetry_count = 5;
+
+const char* telemetry_name(telemetry series) noexcept;
+
 class frontend {
 public:
     frontend(node& node, cluster_transport& transport);
@@ -25,18 +39,27 @@ private:
 
     void draw();
 
+    void record(const status& status);
+
+    void draw_plot(telemetry series);
+
     vec2 space_to_screen(vec2 position);
 
     node& node_;
     cluster_transport& transport_;
-    array<point_t> points_;
+    array<vec2> positions_;
     std::unique_ptr<solver> solver_;
     vec2 screen_size_;
     real scale_factor_;
     u32 frontend_refresh_every_;
     real done_persent_;
-    array<real> energy_vec_;
+    // one bucket per couple of pixels at the default window width
+    static constexpr u32 plot_resolution = 512;
+
+    static_array<time_series<plot_resolution>, telemetry_count> telemetry_;
+    telemetry plotted_ { telemetry::energy };
     bool draw_energy_;
+    bool tracing_;
 };
 
 }
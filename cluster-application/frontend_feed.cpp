@@ -0,0 +1,73 @@
+#include "frontend_feed.hpp"
+
+#include <utility>
+#include <vector>
+
+namespace bh {
+
+frontend_feed::frontend_feed(cluster_transport& transport, u32 frontend)
+    : transport_(transport)
+    , frontend_(frontend)
+{
+}
+
+future<unit> frontend_feed::drain()
+{
+    auto [fut, prom] = create_futue_promice_pair<unit>();
+
+    if (in_flight_) {
+        drained_.emplace(std::move(prom));
+    } else {
+        prom.resolve(unit());
+    }
+
+    return std::move(fut);
+}
+
+void frontend_feed::send_frame()
+{
+    if (!listening_) {
+        transport_.add_handler<frame_ack_message>(
+            frontend_,
+            [this](frame_ack_message) -> unit {
+                acknowledged();
+                return unit();
+            },
+            frame_ack_message {},
+            true);
+        listening_ = true;
+    }
+
+    in_flight_ = true;
+    ++sent_;
+
+    auto [acked, ack] = create_futue_promice_pair<unit>();
+    ack_.emplace(std::move(ack));
+
+    std::vector<future<unit>> frame_done;
+    frame_done.push_back(std::move(acked));
+    frame_done.push_back(transport_.send_batch_async(frontend_, frame_));
+
+    when_all(std::move(frame_done)).then<unit>([this](unit) -> unit {
+        in_flight_ = false;
+
+        if (drained_) {
+            promice<unit> prom = std::move(*drained_);
+            drained_.reset();
+            prom.resolve(unit());
+        }
+
+        return unit();
+    });
+}
+
+void frontend_feed::acknowledged()
+{
+    if (ack_) {
+        promice<unit> prom = std::move(*ack_);
+        ack_.reset();
+        prom.resolve(unit());
+    }
+}
+
+}
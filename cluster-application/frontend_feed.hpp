@@ -0,0 +1,68 @@
+#pragma once
+
+#include <optional>
+
+#include "future.hpp"
+#include "messages.hpp"
+#include "transport.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+// Sends snapshots to the frontend without blocking the simulation. A frame is in flight
+// until its sends are done and the frontend acknowledged it. A snapshot published
+// meanwhile is dropped before it is built, so a slow frontend gets fewer frames and
+// costs the simulation nothing for the others.
+class frontend_feed {
+public:
+    frontend_feed(cluster_transport& transport, u32 frontend);
+
+    frontend_feed(const frontend_feed&) = delete;
+    frontend_feed(frontend_feed&&)      = delete;
+
+    // Snapshot adds the messages of a frame to the batch it is given, it is only called
+    // for a frame that is sent
+    template <typename Snapshot>
+    void publish(Snapshot&& snapshot)
+    {
+        if (in_flight_) {
+            ++dropped_;
+            return;
+        }
+
+        frame_.clear();
+        snapshot(frame_);
+        send_frame();
+    }
+
+    // Resolves once no frame is in flight
+    future<unit> drain();
+
+    u32 sent() const
+    {
+        return sent_;
+    }
+
+    u32 dropped() const
+    {
+        return dropped_;
+    }
+
+private:
+    void send_frame();
+
+    void acknowledged();
+
+    cluster_transport& transport_;
+    u32 frontend_;
+    // One batch with the positions and the status
+    message_batch frame_;
+    bool in_flight_ { false };
+    bool listening_ { false };
+    std::optional<promice<unit>> ack_;
+    std::optional<promice<unit>> drained_;
+    u32 sent_ { 0 };
+    u32 dropped_ { 0 };
+};
+
+}
@@ -1,6 +1,16 @@
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <yaml-cpp/yaml.h>
+
 #include "cluster.hpp"
+#include "ev_loop.hpp"
 #include "logging.hpp"
+#include "messages.hpp"
 #include "transport.hpp"
+#include "transport_backend.hpp"
 
 #include "frontend.hpp"
 #include "master.hpp"
@@ -8,22 +18,88 @@
 
 using namespace bh;
 
+namespace {
+
+    // Runs on its own thread for the local backend, the event loop is per thread
+    void run_rank(std::unique_ptr<transport_backend> backend, idle_policy idle, node_roles roles)
+    {
+        g_event_loop.set_idle_policy(idle);
+
+        node this_node(backend->rank(), backend->ranks(), roles);
+        cluster_transport transport(std::move(backend), cluster_messages::table_size);
+        transport.create_compute_group(this_node.is_computing());
+
+        if (this_node.is_master()) {
+            master_node master(this_node, transport);
+            master.start();
+        } else if (this_node.is_frontend()) {
+            frontend slave(this_node, transport);
+            slave.start();
+        } else {
+            slave_node slave(this_node, transport);
+            slave.start();
+        }
+    }
+
+    void run_local(u32 ranks, idle_policy idle, node_roles roles)
+    {
+        YAML::Node diagnostics = YAML::LoadFile("config.yaml")["diagnostics"];
+        if (diagnostics["tracing"].as<bool>() || diagnostics["perf_counters"].as<bool>()) {
+            throw std::runtime_error("Tracing and perf counters are per process, use the mpi or shm backend");
+        }
+
+        array<std::unique_ptr<transport_backend>> backends = make_local_backends(ranks);
+
+        array<std::thread> threads;
+        for (u32 rank = 1; rank < ranks; ++rank) {
+            threads.emplace_back(run_rank, std::move(backends[rank]), idle, roles);
+        }
+
+        run_rank(std::move(backends[0]), idle, roles);
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // The shared exchange keeps the points of a host's slaves in memory the master
+    // does not have, so the master only computes with the other exchanges. Streaming
+    // forwards every chunk from the master, without sub-masters.
+    node_roles read_roles(const YAML::Node& config)
+    {
+        std::string exchange = config["cluster"]["exchange"].as<std::string>();
+        bool shared          = exchange == "shared";
+        bool streaming       = exchange == "streaming";
+
+        return node_roles { .master_computes = config["cluster"]["master_computes"].as<bool>() && !shared,
+                            .frontend        = config["frontend"]["enable"].as<bool>(),
+                            .group_size      = streaming ? 0 : config["cluster"]["group_size"].as<u32>() };
+    }
+
+}
+
 int main(int argc, char** argv)
 {
     setup_logging();
 
-    node this_node(argc, argv);
-    cluster_transport transport;
+    YAML::Node config  = YAML::LoadFile("config.yaml");
+    YAML::Node cluster = config["cluster"];
+    YAML::Node idle    = cluster["idle"];
+    idle_policy policy { .spin_rounds  = idle["spin_rounds"].as<u32>(),
+                         .yield_rounds = idle["yield_rounds"].as<u32>(),
+                         .max_sleep    = std::chrono::microseconds(idle["max_sleep_us"].as<u32>()) };
+
+    node_roles roles = read_roles(config);
 
-    if (this_node.is_master()) {
-        master_node master(this_node, transport);
-        master.start();
-    } else if (this_node.is_frontend()) {
-        frontend slave(this_node, transport);
-        slave.start();
+    std::string backend = cluster["backend"].as<std::string>();
+    if (backend == "mpi") {
+        run_rank(make_mpi_backend(argc, argv), policy, roles);
+    } else if (backend == "shm") {
+        run_rank(launch_shm_backend(cluster["ranks"].as<u32>(), cluster["ring_capacity"].as<u32>()), policy, roles);
+    } else if (backend == "local") {
+        run_local(cluster["ranks"].as<u32>(), policy, roles);
     } else {
-        slave_node slave(this_node, transport);
-        slave.start();
+        throw std::runtime_error("Unknown cluster.backend: " + backend);
     }
 
     return 0;
@@ -1,19 +1,24 @@
 #include "master.hpp"
 
 #include <fstream>
+#include <stdexcept>
 
 #include <utility>
 #include <yaml-cpp/yaml.h>
 
 #include "chunks.hpp"
 #include "cluster.hpp"
+#include "coroutine.hpp"
 #include "ev_loop.hpp"
 #include "generator.hpp"
 #include "logging.hpp"
+#include "memory_tracking.hpp"
 #include "messages.hpp"
 #include "model.hpp"
+#include "perf_counters.hpp"
 #include "solver.hpp"
 #include "spdlog/fmt/bundled/format.h"
+#include "tracing.hpp"
 #include "transport.hpp"
 #include "types.hpp"
 
@@ -22,6 +27,7 @@ namespace bh {
 master_node::master_node(node& node, cluster_transport& transport)
     : node_(node)
     , transport_(transport)
+    , frontend_feed_(transport, node.frontend_node_index())
 {
 }
 
@@ -43,13 +49,32 @@ void master_node::setup()
 {
     YAML::Node config = YAML::LoadFile("config.yaml");
 
-    enable_frontend_          = config["frontend"]["enable"].as<bool>();
     frontend_refresh_every_   = config["frontend"]["refresh_every"].as<u32>();
     draw_energy_              = config["frontend"]["draw_energy"].as<bool>();
+    quantize_frontend_        = config["frontend"]["quantize"].as<bool>();
     frontend_refresh_counter_ = 0;
 
     enable_output_ = config["output"]["enable"].as<bool>();
 
+    YAML::Node diagnostics = config["diagnostics"];
+
+    diagnostics_      = diagnostics_params { .tracing             = diagnostics["tracing"].as<bool>(),
+                                             .statistics          = diagnostics["statistics"].as<bool>(),
+                                             .perf_counters       = diagnostics["perf_counters"].as<bool>(),
+                                             .memory_report_every = diagnostics["memory_report_every"].as<u32>() };
+    trace_path_       = diagnostics["trace_path"].as<std::string>();
+    statistics_every_ = diagnostics["statistics_every"].as<u32>();
+    step_counter_     = 0;
+    last_step_        = std::chrono::steady_clock::now();
+
+    if (diagnostics_.tracing) {
+        enable_tracing(node_.node_index(), "master");
+    }
+
+    if (diagnostics_.perf_counters) {
+        enable_perf_counters();
+    }
+
     generator_params generator_params { .count        = config["generator"]["count"].as<u32>(),
                                         .scale_factor = config["generator"]["scale_factor"].as<real>() };
 
@@ -58,21 +83,50 @@ void master_node::setup()
                                      .theta              = config["solver"]["theta"].as<real>(),
                                      .epsilon            = config["solver"]["epsilon"].as<real>(),
                                      .accuracy_parameter = config["solver"]["accuracy_parameter"].as<real>(),
-                                     .adaptive_timestep  = config["solver"]["adaptive_timestep"].as<bool>() };
+                                     .adaptive_timestep  = config["solver"]["adaptive_timestep"].as<bool>(),
+                                     .direct_threshold   = config["solver"]["direct_threshold"].as<u32>(),
+                                     .direct_threads     = config["solver"]["direct_threads"].as<u32>() };
+
+    std::string exchange = config["cluster"]["exchange"].as<std::string>();
+    if (exchange == "shared") {
+        exchange_ = exchange_mode::shared;
+    } else if (exchange == "streaming") {
+        exchange_ = exchange_mode::streaming;
+    } else if (exchange == "allgather") {
+        exchange_ = exchange_mode::allgather;
+    } else {
+        exchange_ = exchange_mode::fan_out;
+    }
 
     points_      = generator { generator_params }.generate();
     points_copy_ = points_;
+    kinematics_.resize(points_.size());
 
     nbody_solver_ = std::make_unique<solver>(solver_params_, points_, points_copy_);
 
+    if (diagnostics_.statistics && node_.master_computes()) {
+        nbody_solver_->enable_statistics();
+    }
+
+    // Sub-masters pass setup and points on to their groups
+    downstream_ = node_.downstream_node_indexes();
+
+    // One batch per slave, ahead of the points
+    send_diagnostics();
     send_parameters();
-    send_points();
+    send_exchange();
     send_chunks();
+    transport_.flush();
+
+    send_points();
+
+    // The first step, the slaves take theirs as soon as they have their chunks
+    solve();
 }
 
 void master_node::send_points()
 {
-    for (u32 node : node_.slaves_node_indexes()) {
+    for (u32 node : downstream_) {
         transport_.send_array<point_t>(
             points_.begin(), points_.end(), node, std::to_underlying(cluster_message_type::points));
 
@@ -80,45 +134,256 @@ void master_node::send_points()
     }
 }
 
+void master_node::send_kinematics()
+{
+    for (u32 node : downstream_) {
+        pending_sends_.push_back(transport_.send_array_async<kinematics_t>(
+            kinematics_.begin(), kinematics_.end(), node, std::to_underlying(cluster_message_type::points)));
+
+        LOG_TRACE(fmt::format("Send kinematics: node={}, size={}", node, kinematics_.size()));
+    }
+}
+
 void master_node::send_chunks()
 {
-    slaves_         = node_.slaves_node_indexes();
-    working_chunks_ = make_chunks(points_.size(), slaves_.size());
+    slaves_    = node_.slaves_node_indexes();
+    computing_ = node_.computing_node_indexes();
+    if (computing_.empty()) {
+        throw std::runtime_error("Nobody computes: the job needs a slave rank or cluster.master_computes");
+    }
 
-    for (u32 i = 0; i < slaves_.size(); ++i) {
-        transport_.send_message<chunk_message>(slaves_[i], chunk_message { working_chunks_[i] });
+    working_chunks_ = make_chunks(points_.size(), computing_.size());
 
-        LOG_INFO(fmt::format(
-            "Send chunk: node={}, begin={}, end={}", slaves_[i], working_chunks_[i].begin, working_chunks_[i].end));
+    if (node_.master_computes()) {
+        own_chunk_ = working_chunks_[node_.computing_position(node_.node_index())];
+        LOG_INFO(fmt::format("Own chunk: begin={}, end={}", own_chunk_.begin, own_chunk_.end));
     }
+
+    // Sub-masters hand out the chunks of their groups
+    for (u32 node : downstream_) {
+        chunk node_chunk = working_chunks_[node_.computing_position(node)];
+
+        transport_.post_message<chunk_message>(node, chunk_message { node_chunk });
+
+        LOG_INFO(fmt::format("Send chunk: node={}, begin={}, end={}", node, node_chunk.begin, node_chunk.end));
+    }
+}
+
+// Also advances the time when the master has no chunk
+void master_node::solve()
+{
+    nbody_solver_->step(own_chunk_.begin, own_chunk_.end);
 }
 
 void master_node::stop()
 {
+    if (diagnostics_.tracing) {
+        collect_traces();
+    }
+
+    if (perf_counters_enabled()) {
+        LOG_INFO(fmt::format("Performance counters:\n{}", perf_counters_report()));
+    }
+
+    LOG_INFO(fmt::format("Memory: {}", memory_report()));
+
     stopEvLoop();
 }
 
 void master_node::send_parameters()
 {
-    for (u32 node : node_.slaves_node_indexes()) {
-        transport_.send_message<solver_params_message>(node, solver_params_message { solver_params_ });
+    for (u32 node : downstream_) {
+        transport_.post_message<solver_params_message>(node, solver_params_message { solver_params_ });
 
         LOG_TRACE(fmt::format("Send params: node={}", node));
     }
 }
 
-void master_node::get_solutions()
+void master_node::send_exchange()
+{
+    for (u32 node : downstream_) {
+        transport_.post_message<exchange_message>(node, exchange_message { exchange_ });
+
+        LOG_TRACE(fmt::format("Send exchange mode: node={}", node));
+    }
+}
+
+void master_node::send_diagnostics()
+{
+    for (u32 node : downstream_) {
+        transport_.post_message<diagnostics_message>(node, diagnostics_message { diagnostics_ });
+
+        LOG_TRACE(fmt::format("Send diagnostics: node={}", node));
+    }
+}
+
+void master_node::collect_traces()
+{
+    array<std::string> fragments { trace_events_json() };
+
+    array<u32> nodes = slaves_;
+    if (node_.has_frontend()) {
+        nodes.push_back(node_.frontend_node_index());
+    }
+
+    for (u32 node : nodes) {
+        array<char> fragment
+            = transport_.receive_array<char>(node, std::to_underlying(cluster_message_type::trace));
+        fragments.emplace_back(fragment.begin(), fragment.end());
+    }
+
+    write_chrome_trace(trace_path_, fragments);
+
+    LOG_INFO(fmt::format("Trace written: path={}, processes={}", trace_path_, fragments.size()));
+}
+
+future<unit> master_node::get_solutions()
 {
-    for (u32 i = 0; i < slaves_.size(); ++i) {
-        transport_.receive_array<point_t>(
-            points_.begin() + working_chunks_[i].begin,
-            points_.begin() + working_chunks_[i].end,
-            slaves_[i],
+    // The own chunk was committed to points_ by the last step
+    pack_kinematics(points_, own_chunk_.begin, own_chunk_.end, kinematics_);
+
+    if (exchange_ == exchange_mode::streaming) {
+        return stream_solutions();
+    }
+
+    if (exchange_ != exchange_mode::fan_out) {
+        if (node_.master_computes()) {
+            // A member of the allgather like every slave, nobody has to forward
+            transport_.allgather_array<kinematics_t>(kinematics_, working_chunks_);
+            return when_all({});
+        }
+
+        // Slaves already hold every chunk, the first one forwards the whole array
+        return transport_.receive_array_async<kinematics_t>(
+            kinematics_.begin(), kinematics_.end(), slaves_.front(), std::to_underlying(cluster_message_type::points));
+    }
+
+    // Chunks complete in whatever order the slaves finish, a sub-master's come as one
+    std::vector<future<unit>> chunks;
+    for (u32 node : downstream_) {
+        chunk group = subtree_chunk(node);
+
+        chunks.push_back(transport_.receive_array_async<kinematics_t>(
+            kinematics_.begin() + group.begin,
+            kinematics_.begin() + group.end,
+            node,
+            std::to_underlying(cluster_message_type::points)));
+    }
+
+    return when_all(std::move(chunks));
+}
+
+// The chunks of the slaves node reports for, they are consecutive
+chunk master_node::subtree_chunk(u32 node) const
+{
+    array<u32> subtree = node_.subtree_node_indexes(node);
+
+    return chunk { .begin = working_chunks_[node_.computing_position(subtree.front())].begin,
+                   .end   = working_chunks_[node_.computing_position(subtree.back())].end };
+}
+
+// Every chunk goes on to the slaves without it as soon as it is here, its region of
+// the tree is built while the others are still on their way
+future<unit> master_node::stream_solutions()
+{
+    std::vector<future<unit>> chunks;
+    for (u32 i = 0; i < computing_.size(); ++i) {
+        if (computing_[i] == node_.node_index()) {
+            continue;
+        }
+
+        future<unit> received = transport_.receive_array_async<kinematics_t>(
+            kinematics_.begin() + working_chunks_[i].begin,
+            kinematics_.begin() + working_chunks_[i].end,
+            computing_[i],
             std::to_underlying(cluster_message_type::points));
 
-        LOG_TRACE(fmt::format(
-            "Got solutin: node={}, begin={}, end={}", slaves_[i], working_chunks_[i].begin, working_chunks_[i].end));
+        chunks.push_back(received.then<unit>([this, i](unit) -> unit {
+            forward_region(i);
+            return unit();
+        }));
     }
+
+    // The computing master is first in the compute group
+    if (node_.master_computes()) {
+        forward_region(0);
+    }
+
+    return when_all(std::move(chunks));
+}
+
+void master_node::forward_region(u32 i)
+{
+    chunk region = working_chunks_[i];
+
+    for (u32 node : slaves_) {
+        if (node == computing_[i]) {
+            continue;
+        }
+
+        pending_sends_.push_back(transport_.send_array_async<kinematics_t>(
+            kinematics_.begin() + region.begin, kinematics_.begin() + region.end, node, region_message_type(i)));
+    }
+
+    unpack_kinematics(kinematics_, region.begin, region.end, points_);
+    nbody_solver_->build_tree_region(i, region.begin, region.end);
+}
+
+void master_node::receive_statistics()
+{
+    step_stats_ = solver_stats {};
+
+    real total_step_time = 0.0_r;
+
+    // Of the step taken at the end of the last iteration, the one the slaves just reported
+    if (node_.master_computes()) {
+        step_stats_.merge(nbody_solver_->statistics());
+        total_step_time += nbody_solver_->statistics().step_time;
+    }
+
+    // A sub-master merged its group's already
+    for (u32 node : downstream_) {
+        status_message msg { status {} };
+        transport_.receive_message<status_message>(node, msg);
+        step_stats_.merge(msg.status_.stats);
+        total_step_time += msg.status_.step_time;
+    }
+
+    load_imbalance_ = total_step_time > 0.0_r ? step_stats_.step_time * computing_.size() / total_step_time : 0.0_r;
+}
+
+void master_node::log_statistics()
+{
+    real bodies = std::max(step_stats_.bodies, 1u);
+
+    std::string depths;
+    for (u32 count : step_stats_.depth_histogram) {
+        depths += fmt::format("{} ", count);
+    }
+
+    std::string occupancy;
+    for (u32 count : step_stats_.leaf_occupancy) {
+        occupancy += fmt::format("{} ", count);
+    }
+
+    LOG_INFO(fmt::format(
+        "Step {}: bodies={}, node_interactions/body={:.1f}, point_interactions/body={:.1f}, opened_cells/body={:.1f}, "
+        "max_body_interactions={}",
+        step_counter_,
+        step_stats_.bodies,
+        step_stats_.node_interactions / bodies,
+        step_stats_.point_interactions / bodies,
+        step_stats_.opened_cells / bodies,
+        step_stats_.max_body_interactions));
+
+    LOG_INFO(fmt::format(
+        "Step {}: tree_nodes={}, depth={}, build_time={:.3f}ms, nodes_per_depth=[{}], leaves_per_occupancy=[{}]",
+        step_counter_,
+        step_stats_.tree_nodes,
+        step_stats_.tree_depth,
+        step_stats_.build_time * 1000.0_r,
+        depths,
+        occupancy));
 }
 
 void master_node::write_results()
@@ -130,48 +395,136 @@ void master_node::write_results()
     }
 }
 
+// Never waits for the frontend, frames it is not ready for are dropped before they are built
 void master_node::send_to_frontend()
 {
-    if (enable_frontend_) {
-        transport_.send_array<point_t>(
-            points_.begin(),
-            points_.end(),
-            node_.frontend_node_index(),
-            std::to_underlying(cluster_message_type::points));
+    if (node_.has_frontend()) {
+        frontend_feed_.publish([this](message_batch& frame) {
+            TRACE_SCOPE("frontend_send");
+
+            frontend_positions_.resize(points_.size());
+            for (u32 i = 0; i < points_.size(); ++i) {
+                frontend_positions_[i] = points_[i].position;
+            }
+
+            if (draw_energy_ && !energy_in_flight_) {
+                update_energy();
+            }
 
-        transport_.send_message<status_message>(
-            node_.frontend_node_index(),
-            status_message { status { .done_persent = nbody_solver_->time() / solver_params_.t * 100.0_r,
-                                      .energy       = draw_energy_ ? nbody_solver_->total_energy() : 0.0_r } });
+            frame.add(positions_message { frontend_positions_, quantize_frontend_ });
+            frame.add(status_message { status { .done_persent   = nbody_solver_->time() / solver_params_.t * 100.0_r,
+                                                .energy         = energy_,
+                                                .momentum       = nbody_solver_->total_momentum().len(),
+                                                .dt             = nbody_solver_->timestep(),
+                                                .step_time      = step_time_,
+                                                .load_imbalance = load_imbalance_,
+                                                .stats          = step_stats_ } });
+        });
     }
 }
 
-void master_node::loop()
+// The sum is quadratic in the bodies, so it runs on a copy of the points beside the
+// simulation. Frames show the last finished one.
+void master_node::update_energy()
+{
+    energy_points_.assign(points_.begin(), points_.end());
+    energy_in_flight_ = true;
+
+    g_event_loop
+        .offload<real>(energy_pool_, [this](unit) -> real { return solver::total_energy(energy_points_); })
+        .then<unit>([this](real energy) -> unit {
+            energy_           = energy;
+            energy_in_flight_ = false;
+            return unit();
+        });
+}
+
+void master_node::process_solutions()
 {
-    pushToEvLoop<unit>([this](unit) -> unit {
-        get_solutions();
+    LOG_TRACE(fmt::format("Got solutions: size={}", points_.size()));
+
+    // Streamed chunks are unpacked already, and their regions may have permuted them
+    if (exchange_ != exchange_mode::streaming) {
+        unpack_kinematics(kinematics_, 0, points_.size(), points_);
+    }
+
+    if (diagnostics_.statistics) {
+        receive_statistics();
+    }
+
+    auto now   = std::chrono::steady_clock::now();
+    step_time_ = std::chrono::duration<real>(now - last_step_).count();
+    last_step_ = now;
+
+    if (diagnostics_.statistics && step_counter_ % statistics_every_ == 0) {
+        log_statistics();
+    }
+    if (diagnostics_.memory_report_every != 0 && step_counter_ % diagnostics_.memory_report_every == 0) {
+        LOG_INFO(fmt::format("Memory: step={}, {}", step_counter_, memory_report()));
+    }
+    step_counter_++;
+
+    // Sent before the rebuild, every rank applies the same permutation to the same data
+    if (exchange_ == exchange_mode::fan_out) {
+        TRACE_SCOPE("send");
+        send_kinematics();
+    }
+
+    if (exchange_ == exchange_mode::streaming) {
+        nbody_solver_->join_tree_regions();
+    } else {
         nbody_solver_->rebuild_tree();
-        send_points();
+    }
+}
 
-        nbody_solver_->step(0, 0);
+// One iteration per step, until the simulated time is up
+future<unit> master_node::loop()
+{
+    while (true) {
+        co_await reschedule();
 
-        if (frontend_refresh_counter_ % frontend_refresh_every_ == 0) {
-            send_to_frontend();
+        u64 wait_begin = tracing_enabled() ? trace_clock_ns() : 0;
+
+        // Receives write into kinematics_, so the sends of the previous step have to be done
+        co_await when_all(std::move(pending_sends_));
+        pending_sends_.clear();
+
+        co_await get_solutions();
+
+        if (tracing_enabled()) {
+            trace_record("recv_wait", wait_begin, trace_clock_ns());
         }
-        frontend_refresh_counter_++;
 
+        process_solutions();
+
+        // Same time and same check as on the slaves, which stop after this step too
         if (nbody_solver_->finished()) {
             if (enable_output_) {
                 write_results();
             }
-            transport_.send_message<stop_message>(node_.frontend_node_index(), stop_message {});
+
+            // The frontend stops receiving once it has the stop message
+            if (node_.has_frontend()) {
+                co_await frontend_feed_.drain();
+                LOG_INFO(fmt::format(
+                    "Frontend frames: sent={}, dropped={}", frontend_feed_.sent(), frontend_feed_.dropped()));
+
+                transport_.send_message<stop_message>(node_.frontend_node_index(), stop_message {});
+            }
+
+            co_await when_all(std::move(pending_sends_));
             stop();
+            co_return unit();
         }
 
-        loop();
+        // The next step, while the points are still on their way to the slaves
+        solve();
 
-        return unit();
-    });
+        if (frontend_refresh_counter_ % frontend_refresh_every_ == 0) {
+            send_to_frontend();
+        }
+        frontend_refresh_counter_++;
+    }
 }
 
 }
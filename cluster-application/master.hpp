@@ -1,11 +1,19 @@
 #pragma once
 
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "chunks.hpp"
 #include "cluster.hpp"
+#include "frontend_feed.hpp"
+#include "future.hpp"
+#include "messages.hpp"
 #include "model.hpp"
 #include "solver.hpp"
+#include "thread_pool.hpp"
 #include "transport.hpp"
 #include "types.hpp"
 
@@ -22,33 +30,83 @@ private:
 
     void send_points();
 
+    void send_kinematics();
+
     void send_chunks();
 
+    void solve();
+
     void stop();
 
     void send_parameters();
 
-    void get_solutions();
+    void send_diagnostics();
+
+    void send_exchange();
+
+    void collect_traces();
+
+    void log_statistics();
+
+    future<unit> get_solutions();
 
-    void loop();
+    future<unit> stream_solutions();
+
+    chunk subtree_chunk(u32 node) const;
+
+    void forward_region(u32 i);
+
+    void receive_statistics();
+
+    void process_solutions();
+
+    future<unit> loop();
 
     void write_results();
 
     void send_to_frontend();
 
+    void update_energy();
+
     node& node_;
     cluster_transport& transport_;
     bool enable_output_;
-    bool enable_frontend_;
     solver_params solver_params_;
+    exchange_mode exchange_;
     array<u32> slaves_;
+    // The ranks the master talks to, every slave or the sub-masters
+    array<u32> downstream_;
+    // Ranks with a chunk, the master among them if it computes
+    array<u32> computing_;
     array<chunk> working_chunks_;
-    array<point_t> points_;
-    array<point_t> points_copy_;
+    // Empty unless the master computes
+    chunk own_chunk_ { .begin = 0, .end = 0 };
+    particle_array points_;
+    particle_array points_copy_;
+    // Per step state in the current body order, received into and sent from
+    kinematics_array kinematics_;
+    array<vec2> frontend_positions_;
+    bool quantize_frontend_;
+    frontend_feed frontend_feed_;
     std::unique_ptr<solver> nbody_solver_;
+    // Sends still reading kinematics_, they have to finish before it is written again
+    std::vector<future<unit>> pending_sends_;
     u32 frontend_refresh_every_;
     u32 frontend_refresh_counter_;
     bool draw_energy_;
+    // Summed on energy_pool_, which is destroyed first and lets the last sum finish
+    particle_array energy_points_;
+    bool energy_in_flight_ { false };
+    real energy_ { std::numeric_limits<real>::quiet_NaN() };
+    thread_pool energy_pool_ { 1 };
+    diagnostics_params diagnostics_;
+    u32 statistics_every_;
+    u32 step_counter_;
+    solver_stats step_stats_;
+    std::chrono::steady_clock::time_point last_step_;
+    real step_time_ { 0.0_r };
+    real load_imbalance_ { 0.0_r };
+    std::string trace_path_;
 };
 
 }
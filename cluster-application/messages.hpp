@@ -1,8 +1,16 @@
 #pragma once
 
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
 #include "chunks.hpp"
+#include "linalg.hpp"
+#include "memory_tracking.hpp"
 #include "model.hpp"
 #include "solver.hpp"
+#include "transport.hpp"
 #include "types.hpp"
 
 namespace bh {
@@ -13,10 +21,60 @@ enum class cluster_message_type : u32 {
     points        = 3,
     stop          = 4,
     status        = 5,
+    diagnostics   = 6,
+    trace         = 7,
+    exchange      = 8,
+    positions     = 9,
+    frame_ack     = 10,
+    // Kinematics of chunk i with exchange_mode::streaming come as type region + i
+    region        = 16,
+};
+
+// How updated chunks reach the slaves every step
+enum class exchange_mode : u32 {
+    // slaves send chunks to the master, the master sends all points back to every slave
+    fan_out = 0,
+    // slaves allgather chunks among themselves, the first slave forwards all points to the master
+    allgather = 1,
+    // like allgather, but the slaves of a host share points and tree in an MPI-3 shared
+    // window, one of them builds the tree and takes part in the exchange
+    shared = 2,
+    // like fan_out, but the master forwards every chunk as soon as it has it, and every
+    // rank builds the chunk's region of the tree meanwhile
+    streaming = 3,
+};
+
+// Type of chunk i's kinematics with exchange_mode::streaming
+inline u32 region_message_type(u32 chunk)
+{
+    return std::to_underlying(cluster_message_type::region) + chunk;
+}
+
+struct exchange_message {
+    static constexpr cluster_message_type msg_type = cluster_message_type::exchange;
+    static constexpr bool zero_copy                = true;
+
+    exchange_mode mode_;
+
+    void parce(const void* buffer)
+    {
+        mode_ = *reinterpret_cast<const exchange_mode*>(buffer);
+    }
+
+    size_t size()
+    {
+        return sizeof(exchange_mode);
+    }
+
+    void serialize(void* buffer)
+    {
+        *reinterpret_cast<exchange_mode*>(buffer) = mode_;
+    }
 };
 
 struct chunk_message {
     static constexpr cluster_message_type msg_type = cluster_message_type::chunk;
+    static constexpr bool zero_copy                = true;
 
     chunk chunk_;
 
@@ -38,6 +96,7 @@ struct chunk_message {
 
 struct solver_params_message {
     static constexpr cluster_message_type msg_type = cluster_message_type::solver_params;
+    static constexpr bool zero_copy                = true;
 
     solver_params params_;
 
@@ -57,29 +116,126 @@ struct solver_params_message {
     }
 };
 
-struct points_message {
-    static constexpr cluster_message_type msg_type = cluster_message_type::points;
+// Per step state of a body. Masses only travel once, with the initial points, and
+// every rank permutes its array the same way when it rebuilds the tree.
+struct kinematics_t {
+    vec2 position;
+    vec2 velocity;
+};
+
+using kinematics_array = tracked_array<kinematics_t, memory_tag::transport>;
+
+inline void pack_kinematics(std::span<const point_t> points, u32 begin, u32 end, kinematics_array& kinematics)
+{
+    for (u32 i = begin; i < end; ++i) {
+        kinematics[i] = kinematics_t { .position = points[i].position, .velocity = points[i].velocity };
+    }
+}
+
+inline void unpack_kinematics(const kinematics_array& kinematics, u32 begin, u32 end, particle_span points)
+{
+    for (u32 i = begin; i < end; ++i) {
+        points[i].position = kinematics[i].position;
+        points[i].velocity = kinematics[i].velocity;
+    }
+}
+
+// Body positions for the frontend. A quantized frame stores every coordinate as a
+// 16 bit fraction of the frame's bounding box, off by at most extent / 2^17.
+struct positions_message {
+    static constexpr cluster_message_type msg_type = cluster_message_type::positions;
+
+    struct header {
+        u32 count;
+        u32 quantized;
+        vec2 min;
+        vec2 max;
+    };
+
+    static constexpr real quantization_levels = 65535.0;
 
-    array<point_t>& points_;
+    array<vec2>& positions_;
+    bool quantize_ { false };
 
     void parce(const void* buffer)
     {
-        memcpy(points_.data(), buffer, points_.size() * sizeof(point_t));
+        header head = *reinterpret_cast<const header*>(buffer);
+        positions_.resize(head.count);
+
+        const std::byte* payload = reinterpret_cast<const std::byte*>(buffer) + sizeof(header);
+
+        if (!head.quantized) {
+            memcpy(positions_.data(), payload, head.count * sizeof(vec2));
+            return;
+        }
+
+        const u16* values = reinterpret_cast<const u16*>(payload);
+        vec2 step         = (head.max - head.min) / quantization_levels;
+
+        for (u32 i = 0; i < head.count; ++i) {
+            positions_[i] = vec2 { head.min[0] + values[2 * i] * step[0], head.min[1] + values[2 * i + 1] * step[1] };
+        }
     }
 
     size_t size()
     {
-        return sizeof(point_t) * points_.size();
+        return sizeof(header) + positions_.size() * (quantize_ ? 2 * sizeof(u16) : sizeof(vec2));
     }
 
     void serialize(void* buffer)
     {
-        memcpy(buffer, points_.data(), points_.size() * sizeof(point_t));
+        header head { .count = static_cast<u32>(positions_.size()), .quantized = quantize_, .min = {}, .max = {} };
+
+        std::byte* payload = reinterpret_cast<std::byte*>(buffer) + sizeof(header);
+
+        if (!quantize_) {
+            *reinterpret_cast<header*>(buffer) = head;
+            memcpy(payload, positions_.data(), positions_.size() * sizeof(vec2));
+            return;
+        }
+
+        head.min = vec2 { std::numeric_limits<real>::max(), std::numeric_limits<real>::max() };
+        head.max = vec2 { std::numeric_limits<real>::lowest(), std::numeric_limits<real>::lowest() };
+        for (const vec2& position : positions_) {
+            head.min = vec2::min(head.min, position);
+            head.max = vec2::max(head.max, position);
+        }
+        *reinterpret_cast<header*>(buffer) = head;
+
+        u16* values = reinterpret_cast<u16*>(payload);
+        vec2 extent = head.max - head.min;
+
+        for (u32 i = 0; i < positions_.size(); ++i) {
+            for (u32 axis = 0; axis < 2; ++axis) {
+                real fraction = extent[axis] > 0.0_r ? (positions_[i][axis] - head.min[axis]) / extent[axis] : 0.0_r;
+                values[2 * i + axis] = static_cast<u16>(std::lround(fraction * quantization_levels));
+            }
+        }
     }
 };
 
 struct stop_message {
     static constexpr cluster_message_type msg_type = cluster_message_type::stop;
+    static constexpr bool zero_copy                = true;
+
+    void parce(const void*)
+    {
+    }
+
+    size_t size()
+    {
+        return 1;
+    }
+
+    void serialize(void*)
+    {
+    }
+};
+
+// The frontend got a positions message and is ready for the next one
+struct frame_ack_message {
+    static constexpr cluster_message_type msg_type = cluster_message_type::frame_ack;
+    static constexpr bool zero_copy                = true;
 
     void parce(const void*)
     {
@@ -97,11 +253,22 @@ struct stop_message {
 
 struct status {
     real done_persent;
+    // total energy of a recent step, NaN before the first one is summed
     real energy;
+    // magnitude of the total momentum
+    real momentum;
+    real dt;
+    // wall time of the last step on the master, from a slave the summed traversal time
+    // of the slaves it reports for
+    real step_time;
+    // slowest over mean slave traversal time, 0 without statistics
+    real load_imbalance;
+    solver_stats stats;
 };
 
 struct status_message {
     static constexpr cluster_message_type msg_type = cluster_message_type::status;
+    static constexpr bool zero_copy                = true;
 
     status status_;
 
@@ -121,4 +288,45 @@ struct status_message {
     }
 };
 
+struct diagnostics_params {
+    bool tracing;
+    bool statistics;
+    bool perf_counters;
+    // steps between memory reports, 0 reports only at exit
+    u32 memory_report_every;
+};
+
+struct diagnostics_message {
+    static constexpr cluster_message_type msg_type = cluster_message_type::diagnostics;
+    static constexpr bool zero_copy                = true;
+
+    diagnostics_params params_;
+
+    void parce(const void* buffer)
+    {
+        params_ = *reinterpret_cast<const diagnostics_params*>(buffer);
+    }
+
+    size_t size()
+    {
+        return sizeof(diagnostics_params);
+    }
+
+    void serialize(void* buffer)
+    {
+        *reinterpret_cast<diagnostics_params*>(buffer) = params_;
+    }
+};
+
+// Every message a handler can wait for, points and trace are plain arrays
+using cluster_messages = message_registry<
+    exchange_message,
+    chunk_message,
+    solver_params_message,
+    positions_message,
+    stop_message,
+    frame_ack_message,
+    status_message,
+    diagnostics_message>;
+
 }
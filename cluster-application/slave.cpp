@@ -1,12 +1,19 @@
 #include "slave.hpp"
 
+#include <algorithm>
+#include <vector>
+
 #include "chunks.hpp"
 #include "cluster.hpp"
+#include "coroutine.hpp"
 #include "ev_loop.hpp"
 #include "logging.hpp"
+#include "memory_tracking.hpp"
 #include "messages.hpp"
 #include "model.hpp"
+#include "perf_counters.hpp"
 #include "solver.hpp"
+#include "tracing.hpp"
 #include "transport.hpp"
 #include "types.hpp"
 
@@ -31,106 +38,483 @@ void slave_node::start()
     LOG_INFO("Exiting slave application...");
 }
 
-void slave_node::setup()
+// Setup messages arrive in the order the master sends them, a sub-master passes them on
+// in the same order
+future<unit> slave_node::setup()
 {
-    get_parameters();
+    upstream_   = node_.upstream_node_index();
+    downstream_ = node_.downstream_node_indexes();
+
+    diagnostics_ = (co_await transport_.receive<diagnostics_message>(upstream_)).params_;
+
+    if (diagnostics_.tracing) {
+        enable_tracing(node_.node_index(), fmt::format("slave {}", node_.node_index()));
+    }
+
+    if (diagnostics_.perf_counters) {
+        enable_perf_counters();
+    }
+
+    LOG_TRACE(fmt::format("[node: {}] Got diagnostics", node_.node_index()));
+
+    solver_params_ = (co_await transport_.receive<solver_params_message>(upstream_)).params_;
+
+    LOG_TRACE(fmt::format("[node: {}] Got params", node_.node_index()));
+
+    exchange_ = (co_await transport_.receive<exchange_message>(upstream_)).mode_;
+
+    LOG_TRACE(fmt::format("[node: {}] Got exchange mode", node_.node_index()));
+
+    for (u32 node : downstream_) {
+        transport_.post_message<diagnostics_message>(node, diagnostics_message { diagnostics_ });
+        transport_.post_message<solver_params_message>(node, solver_params_message { solver_params_ });
+        transport_.post_message<exchange_message>(node, exchange_message { exchange_ });
+    }
+
+    get_points();
+
+    working_chunk_ = (co_await transport_.receive<chunk_message>(upstream_)).chunk_;
+    // Same split as the master's, the allgather needs every computing rank's chunk
+    array<u32> computing = node_.computing_node_indexes();
+    chunks_              = make_chunks(points_.size(), computing.size());
+    chunk_index_         = std::find(computing.begin(), computing.end(), node_.node_index()) - computing.begin();
+
+    LOG_INFO(fmt::format(
+        "[node: {}] Got chunk: begin={}, end={}", node_.node_index(), working_chunk_.begin, working_chunk_.end));
+
+    if (!downstream_.empty()) {
+        forward_setup();
+    }
+
+    if (exchange_ == exchange_mode::shared) {
+        share_points();
+    }
+
+    create_solver();
+
+    co_await loop();
+    co_return unit();
 }
 
 void slave_node::get_points()
 {
-    points_ = transport_.receive_array<point_t>(
-        node_.master_node_index(), std::to_underlying(cluster_message_type::points));
-    points_copy_ = points_;
+    own_points_ = transport_.receive_array<point_t, particle_array>(
+        upstream_, std::to_underlying(cluster_message_type::points));
+    own_points_copy_ = own_points_;
+    points_          = own_points_;
+    points_copy_     = own_points_copy_;
+    kinematics_.resize(points_.size());
 
     LOG_TRACE(fmt::format("[node: {}] Got points: size={}", node_.node_index(), points_.size()));
+}
 
-    nbody_solver_ = std::make_unique<solver>(solver_params_, points_, points_copy_);
+// The chunks of the group, then the points, like the master sends them
+void slave_node::forward_setup()
+{
+    for (u32 node : downstream_) {
+        chunk node_chunk = chunks_[node_.computing_position(node)];
+        transport_.post_message<chunk_message>(node, chunk_message { node_chunk });
+    }
+    transport_.flush();
 
-    transport_.add_handler<chunk_message>(
-        node_.master_node_index(),
-        [this](chunk_message msg) -> unit {
-            working_chunk_ = msg.chunk_;
+    for (u32 node : downstream_) {
+        transport_.send_array<point_t>(
+            points_.begin(), points_.end(), node, std::to_underlying(cluster_message_type::points));
 
-            LOG_INFO(fmt::format(
-                "[node: {}] Got chunk: begin={}, end={}",
-                node_.node_index(),
-                working_chunk_.begin,
-                working_chunk_.end));
+        LOG_TRACE(fmt::format("[node: {}] Forward points: node={}", node_.node_index(), node));
+    }
+}
 
-            loop();
+// The chunks of the slaves node reports for, they are consecutive
+chunk slave_node::subtree_chunk(u32 node) const
+{
+    array<u32> subtree = node_.subtree_node_indexes(node);
 
-            return unit();
-        },
-        chunk_message { working_chunk_ });
+    return chunk { .begin = chunks_[node_.computing_position(subtree.front())].begin,
+                   .end   = chunks_[node_.computing_position(subtree.back())].end };
+}
+
+// Moves both copies of the points into memory shared by the slaves of this host. Every
+// slave still receives the points once, only the host's leader keeps them afterwards.
+void slave_node::share_points()
+{
+    host_ = transport_.create_host_group();
+    if (!host_) {
+        LOG_WARN(fmt::format(
+            "[node: {}] Slaves of a host do not share memory or are not contiguous, exchanging with allgather",
+            node_.node_index()));
+        exchange_ = exchange_mode::allgather;
+        return;
+    }
+
+    u32 size                    = own_points_.size();
+    std::span<std::byte> memory = allocate_shared(2 * size * sizeof(point_t), memory_tag::particles);
+    points_                     = particle_span(reinterpret_cast<point_t*>(memory.data()), size);
+    points_copy_                = particle_span(points_.data() + size, size);
+
+    if (host_->rank() == 0) {
+        std::copy(own_points_.begin(), own_points_.end(), points_.begin());
+        std::copy(own_points_.begin(), own_points_.end(), points_copy_.begin());
+    }
+    own_points_      = particle_array();
+    own_points_copy_ = particle_array();
+
+    // A host owns the chunks of its slaves, which are contiguous
+    u32 first = 0;
+    for (u32 host_size : host_->host_sizes()) {
+        host_chunks_.push_back(chunk { .begin = chunks_[first].begin, .end = chunks_[first + host_size - 1].end });
+        first += host_size;
+    }
+
+    host_->barrier();
+
+    LOG_INFO(fmt::format(
+        "[node: {}] Sharing points: host={}, rank={}, size={}",
+        node_.node_index(),
+        host_->host(),
+        host_->rank(),
+        host_->size()));
 }
 
-void slave_node::update_points()
+// Slaves of a host traverse the tree their leader builds
+void slave_node::create_solver()
 {
-    transport_.receive_array<point_t>(
-        points_.begin(), points_.end(), node_.master_node_index(), std::to_underlying(cluster_message_type::points));
+    bool follower = exchange_ == exchange_mode::shared && host_->rank() != 0;
+
+    if (!follower) {
+        nbody_solver_ = std::make_unique<solver>(solver_params_, points_, points_copy_);
+    }
+
+    if (exchange_ == exchange_mode::shared) {
+        share_tree();
+    }
+
+    if (follower) {
+        nbody_solver_ = std::make_unique<solver>(solver_params_, points_, points_copy_, shared_tree_);
+    }
+
+    if (diagnostics_.statistics) {
+        nbody_solver_->enable_statistics();
+    }
+}
+
+// The leader publishes its tree, the memory grows collectively when it does not fit
+void slave_node::share_tree()
+{
+    bool leader = host_->rank() == 0;
+
+    if (shared_tree_.empty()) {
+        shared_tree_ = allocate_shared(solver::quadree::shared_bytes(points_.size()), memory_tag::tree);
+    }
+
+    if (leader) {
+        nbody_solver_->publish_tree(shared_tree_);
+    }
+    host_->barrier();
+
+    size_t needed = solver::quadree::published_bytes(shared_tree_);
+    if (needed <= shared_tree_.size()) {
+        return;
+    }
+
+    // With headroom, so a tree growing slowly does not reallocate every step
+    release_shared(shared_tree_, memory_tag::tree);
+    shared_tree_ = allocate_shared(needed + needed / 2, memory_tag::tree);
+
+    if (leader) {
+        nbody_solver_->publish_tree(shared_tree_);
+    }
+    host_->barrier();
+}
+
+// Accounted once per host, to its leader
+std::span<std::byte> slave_node::allocate_shared(size_t bytes, memory_tag tag)
+{
+    if (host_->rank() == 0) {
+        memory_allocated(tag, bytes);
+    }
+
+    return host_->allocate(bytes);
+}
+
+void slave_node::release_shared(std::span<std::byte> memory, memory_tag tag)
+{
+    if (host_->rank() == 0) {
+        memory_deallocated(tag, memory.size());
+    }
+
+    host_->release(memory);
+}
+
+// A sub-master passes the points on before it unpacks them
+future<unit> slave_node::update_points()
+{
+    co_await transport_.receive_array_async<kinematics_t>(
+        kinematics_.begin(), kinematics_.end(), upstream_, std::to_underlying(cluster_message_type::points));
+
+    for (u32 node : downstream_) {
+        pending_sends_.push_back(transport_.send_array_async<kinematics_t>(
+            kinematics_.begin(), kinematics_.end(), node, std::to_underlying(cluster_message_type::points)));
+    }
+
+    unpack_kinematics(kinematics_, 0, points_.size(), points_);
 
     LOG_TRACE(fmt::format("[node: {}] Updated points: size={}", node_.node_index(), points_.size()));
+    co_return unit();
+}
+
+// The own region is built first, the others as they come in from the master
+future<unit> slave_node::stream_points()
+{
+    std::vector<future<unit>> regions;
+    for (u32 i = 0; i < chunks_.size(); ++i) {
+        if (i == chunk_index_) {
+            continue;
+        }
+
+        future<unit> received = transport_.receive_array_async<kinematics_t>(
+            kinematics_.begin() + chunks_[i].begin,
+            kinematics_.begin() + chunks_[i].end,
+            node_.master_node_index(),
+            region_message_type(i));
+
+        regions.push_back(received.then<unit>([this, i](unit) -> unit {
+            unpack_kinematics(kinematics_, chunks_[i].begin, chunks_[i].end, points_);
+            nbody_solver_->build_tree_region(i, chunks_[i].begin, chunks_[i].end);
+            return unit();
+        }));
+    }
+
+    nbody_solver_->build_tree_region(chunk_index_, working_chunk_.begin, working_chunk_.end);
+
+    co_await when_all(std::move(regions));
+
+    LOG_TRACE(fmt::format("[node: {}] Streamed points: size={}", node_.node_index(), points_.size()));
+    co_return unit();
 }
 
 void slave_node::solve()
 {
-    nbody_solver_->step(working_chunk_.begin, working_chunk_.end);
+    if (exchange_ == exchange_mode::shared) {
+        // Committed by the leader once every slave of the host is done reading
+        nbody_solver_->integrate(working_chunk_.begin, working_chunk_.end);
+    } else {
+        nbody_solver_->step(working_chunk_.begin, working_chunk_.end);
+    }
 }
 
-void slave_node::send_solution()
+// A sub-master sends its group's chunks along with its own, as one range
+future<unit> slave_node::send_solution()
 {
-    transport_.send_array<point_t>(
-        points_.begin() + working_chunk_.begin,
-        points_.begin() + working_chunk_.end,
-        node_.master_node_index(),
+    pack_kinematics(points_, working_chunk_.begin, working_chunk_.end, kinematics_);
+
+    std::vector<future<unit>> groups;
+    for (u32 node : downstream_) {
+        chunk group = subtree_chunk(node);
+
+        groups.push_back(transport_.receive_array_async<kinematics_t>(
+            kinematics_.begin() + group.begin,
+            kinematics_.begin() + group.end,
+            node,
+            std::to_underlying(cluster_message_type::points)));
+    }
+
+    co_await when_all(std::move(groups));
+
+    chunk solution = subtree_chunk(node_.node_index());
+
+    transport_.send_array<kinematics_t>(
+        kinematics_.begin() + solution.begin,
+        kinematics_.begin() + solution.end,
+        upstream_,
         std::to_underlying(cluster_message_type::points));
 
     LOG_TRACE(fmt::format(
-        "[node: {}] Send solutin: begin={}, end={}", node_.node_index(), working_chunk_.begin, working_chunk_.end));
+        "[node: {}] Send solutin: begin={}, end={}", node_.node_index(), solution.begin, solution.end));
+    co_return unit();
 }
 
-void slave_node::get_parameters()
+void slave_node::exchange_points()
 {
-    transport_.add_handler<solver_params_message>(
-        node_.master_node_index(),
-        [this](solver_params_message msg) -> unit {
-            solver_params_ = msg.params_;
+    pack_kinematics(points_, working_chunk_.begin, working_chunk_.end, kinematics_);
 
-            LOG_TRACE(fmt::format("[node: {}] Got params", node_.node_index()));
+    transport_.allgather_array<kinematics_t>(kinematics_, chunks_);
 
-            get_points();
+    unpack_kinematics(kinematics_, 0, points_.size(), points_);
 
-            return unit();
-        },
-        solver_params_message { solver_params_ });
+    if (forwards_points()) {
+        transport_.send_array<kinematics_t>(
+            kinematics_.begin(),
+            kinematics_.end(),
+            node_.master_node_index(),
+            std::to_underlying(cluster_message_type::points));
+    }
+
+    LOG_TRACE(fmt::format("[node: {}] Exchanged points: size={}", node_.node_index(), points_.size()));
+}
+
+// Only the leaders exchange, each of them on behalf of its host
+void slave_node::exchange_shared_points()
+{
+    host_->barrier();
+
+    if (host_->rank() != 0) {
+        return;
+    }
+
+    chunk own = host_chunks_[host_->host()];
+    nbody_solver_->commit(own.begin, own.end);
+
+    pack_kinematics(points_, own.begin, own.end, kinematics_);
+
+    cluster_transport::allgather_leaders_array<kinematics_t>(*host_, kinematics_, host_chunks_);
+
+    unpack_kinematics(kinematics_, 0, points_.size(), points_);
+
+    if (forwards_points()) {
+        transport_.send_array<kinematics_t>(
+            kinematics_.begin(),
+            kinematics_.end(),
+            node_.master_node_index(),
+            std::to_underlying(cluster_message_type::points));
+    }
+
+    LOG_TRACE(fmt::format("[node: {}] Exchanged shared points: size={}", node_.node_index(), points_.size()));
+}
+
+// A computing master takes part in the allgather itself
+bool slave_node::forwards_points() const
+{
+    return !node_.master_computes() && node_.node_index() == node_.slaves_node_indexes().front();
+}
+
+// Merged with the statistics of the group, the master sees one message per sub-master
+void slave_node::send_statistics()
+{
+    solver_stats stats = nbody_solver_->statistics();
+    real step_time     = stats.step_time;
+
+    for (u32 node : downstream_) {
+        status_message msg { status {} };
+        transport_.receive_message<status_message>(node, msg);
+        stats.merge(msg.status_.stats);
+        step_time += msg.status_.step_time;
+    }
+
+    transport_.send_message<status_message>(
+        upstream_,
+        status_message { status { .done_persent   = nbody_solver_->time() / solver_params_.t * 100.0_r,
+                                  .energy         = 0.0_r,
+                                  .momentum       = 0.0_r,
+                                  .dt             = nbody_solver_->timestep(),
+                                  .step_time      = step_time,
+                                  .load_imbalance = 0.0_r,
+                                  .stats          = stats } });
+}
+
+void slave_node::send_trace()
+{
+    std::string events = trace_events_json();
+
+    transport_.send_array<char>(
+        array<char>(events.begin(), events.end()),
+        node_.master_node_index(),
+        std::to_underlying(cluster_message_type::trace));
 }
 
 void slave_node::stop()
 {
+    if (diagnostics_.tracing) {
+        send_trace();
+    }
+
+    if (perf_counters_enabled()) {
+        LOG_INFO(fmt::format("[node: {}] Performance counters:\n{}", node_.node_index(), perf_counters_report()));
+    }
+
+    LOG_INFO(fmt::format("[node: {}] Memory: {}", node_.node_index(), memory_report()));
+
     stopEvLoop();
 }
 
 void slave_node::rebuild_tree()
 {
-    nbody_solver_->rebuild_tree();
+    if (exchange_ == exchange_mode::streaming) {
+        nbody_solver_->join_tree_regions();
+        return;
+    }
+
+    if (exchange_ != exchange_mode::shared) {
+        nbody_solver_->rebuild_tree();
+        return;
+    }
+
+    if (host_->rank() == 0) {
+        nbody_solver_->rebuild_tree();
+    }
+
+    share_tree();
+
+    if (host_->rank() != 0) {
+        nbody_solver_->attach_tree(shared_tree_);
+    }
 }
 
-void slave_node::loop()
+// One iteration per step, until the simulated time is up
+future<unit> slave_node::loop()
 {
-    pushToEvLoop<unit>([this](unit) -> unit {
+    while (true) {
+        co_await reschedule();
+
+        // The points passed on to the group are read until these are done
+        co_await when_all(std::move(pending_sends_));
+        pending_sends_.clear();
+
         solve();
-        send_solution();
-        update_points();
+
+        {
+            TRACE_SCOPE("send");
+            if (exchange_ == exchange_mode::shared) {
+                exchange_shared_points();
+            } else if (exchange_ == exchange_mode::allgather) {
+                exchange_points();
+            } else {
+                co_await send_solution();
+            }
+
+            if (diagnostics_.statistics) {
+                send_statistics();
+            }
+        }
+
+        if (exchange_ == exchange_mode::fan_out || exchange_ == exchange_mode::streaming) {
+            u64 wait_begin = tracing_enabled() ? trace_clock_ns() : 0;
+
+            if (exchange_ == exchange_mode::streaming) {
+                co_await stream_points();
+            } else {
+                co_await update_points();
+            }
+
+            if (tracing_enabled()) {
+                trace_record("recv_wait", wait_begin, trace_clock_ns());
+            }
+        }
+
+        if (diagnostics_.memory_report_every != 0 && step_counter_ % diagnostics_.memory_report_every == 0) {
+            LOG_INFO(
+                fmt::format("[node: {}] Memory: step={}, {}", node_.node_index(), step_counter_, memory_report()));
+        }
+        step_counter_++;
+
         rebuild_tree();
 
         if (nbody_solver_->finished()) {
+            co_await when_all(std::move(pending_sends_));
             stop();
+            co_return unit();
         }
-
-        loop();
-
-        return unit();
-    });
+    }
 }
 
 }
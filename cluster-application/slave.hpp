@@ -1,12 +1,19 @@
 #pragma once
 
+#include <cstddef>
 #include <memory>
+#include <span>
+#include <vector>
 
 #include "chunks.hpp"
 #include "cluster.hpp"
+#include "future.hpp"
+#include "memory_tracking.hpp"
+#include "messages.hpp"
 #include "model.hpp"
 #include "solver.hpp"
 #include "transport.hpp"
+#include "transport_backend.hpp"
 #include "types.hpp"
 
 namespace bh {
@@ -18,31 +25,74 @@ public:
     void start();
 
 private:
-    void setup();
+    future<unit> setup();
 
     void get_points();
 
-    void update_points();
+    void forward_setup();
+
+    chunk subtree_chunk(u32 node) const;
+
+    void share_points();
+
+    void create_solver();
+
+    void share_tree();
+
+    std::span<std::byte> allocate_shared(size_t bytes, memory_tag tag);
+
+    void release_shared(std::span<std::byte> memory, memory_tag tag);
+
+    future<unit> update_points();
+
+    future<unit> stream_points();
 
     void solve();
 
-    void send_solution();
+    future<unit> send_solution();
+
+    void exchange_points();
+
+    void exchange_shared_points();
+
+    bool forwards_points() const;
+
+    void send_statistics();
 
-    void get_parameters();
+    void send_trace();
 
     void stop();
 
     void rebuild_tree();
 
-    void loop();
+    future<unit> loop();
 
     node& node_;
     cluster_transport& transport_;
+    // The master or the sub-master of the group, and the sub-masters below this rank
+    u32 upstream_ { 0 };
+    array<u32> downstream_;
     solver_params solver_params_;
-    array<point_t> points_;
-    array<point_t> points_copy_;
+    diagnostics_params diagnostics_;
+    // Empty once the points moved to memory shared with the host
+    particle_array own_points_;
+    particle_array own_points_copy_;
+    particle_span points_;
+    particle_span points_copy_;
+    kinematics_array kinematics_;
+    exchange_mode exchange_;
     chunk working_chunk_;
+    array<chunk> chunks_;
+    // Of the working chunk in chunks_
+    u32 chunk_index_ { 0 };
+    // Only with exchange_mode::shared
+    std::unique_ptr<host_group> host_;
+    array<chunk> host_chunks_;
+    std::span<std::byte> shared_tree_;
+    u32 step_counter_ { 0 };
     std::unique_ptr<solver> nbody_solver_;
+    // Points passed on to the group, kinematics_ is not written until they are done
+    std::vector<future<unit>> pending_sends_;
 };
 
 }
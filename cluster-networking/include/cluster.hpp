@@ -1,35 +1,68 @@
 #pragma once
 
+#include <algorithm>
 #include <numeric>
 
 #include "types.hpp"
 
 namespace bh {
 
+// Which roles the job has, the same on every rank
+struct node_roles {
+    // The master takes a chunk of bodies like a slave does
+    bool master_computes { false };
+    // Rank 1 runs the frontend, without one it is a slave as well
+    bool frontend { true };
+    // Most ranks the master and each sub-master pass data on to, 0 for the master to
+    // talk to every slave itself
+    u32 group_size { 0 };
+};
+
+// Role of a rank, derived from its index. Rank 0 is the master, rank 1 the frontend
+// if there is one, all others are slaves. With a group size the slaves form a tree
+// under the master: the slaves below a rank are split into at most group size groups
+// of consecutive ranks, the first slave of a group is its sub-master.
 class node {
 public:
-    node(int argc, char** argv);
-    ~node();
+    node(u32 index, u32 count, node_roles roles = {})
+        : node_index_(index)
+        , nodes_count_(count)
+        , roles_(roles)
+    {
+    }
 
     node(const node&) = delete;
     node(node&&)      = delete;
 
     bool is_master() const noexcept
     {
-        if (node_index_ == 0) {
-            return true;
-        } else {
-            return false;
-        }
+        return node_index_ == master_node_index();
     }
 
     bool is_frontend() const noexcept
     {
-        if (node_index_ == 1) {
-            return true;
-        } else {
-            return false;
-        }
+        return roles_.frontend && node_index_ == frontend_node_index();
+    }
+
+    bool is_slave() const noexcept
+    {
+        return !is_master() && !is_frontend();
+    }
+
+    // Ranks with a chunk of bodies, they form the compute group
+    bool is_computing() const noexcept
+    {
+        return is_slave() || (is_master() && roles_.master_computes);
+    }
+
+    bool has_frontend() const noexcept
+    {
+        return roles_.frontend;
+    }
+
+    bool master_computes() const noexcept
+    {
+        return roles_.master_computes;
     }
 
     u32 nodes_count() const noexcept
@@ -47,6 +80,7 @@ public:
         return 0;
     }
 
+    // Only meaningful with has_frontend()
     u32 frontend_node_index() const noexcept
     {
         return 1;
@@ -54,14 +88,124 @@ public:
 
     array<u32> slaves_node_indexes() const noexcept
     {
-        array<u32> slaves(nodes_count_ - 2);
-        std::iota(std::begin(slaves), std::end(slaves), 2);
+        array<u32> slaves(slaves_count());
+        std::iota(std::begin(slaves), std::end(slaves), first_slave_index());
         return slaves;
     }
 
+    // The rank a slave gets setup and points from and reports to
+    u32 upstream_node_index() const noexcept
+    {
+        return is_slave() ? group_of(node_index_ - first_slave_index()).upstream : master_node_index();
+    }
+
+    // The sub-masters a rank passes setup and points on to and gathers from, all
+    // slaves for the master without a group size
+    array<u32> downstream_node_indexes() const noexcept
+    {
+        array<slave_group> groups;
+        if (is_master()) {
+            groups = split(master_node_index(), 0, slaves_count());
+        } else if (is_slave()) {
+            slave_group own = group_of(node_index_ - first_slave_index());
+            groups          = split(node_index_, own.first + 1, own.last);
+        }
+
+        array<u32> nodes;
+        for (const slave_group& group : groups) {
+            nodes.push_back(first_slave_index() + group.first);
+        }
+        return nodes;
+    }
+
+    // Slaves a rank reports for, consecutive and the rank itself first. All of them
+    // for the master.
+    array<u32> subtree_node_indexes(u32 index) const noexcept
+    {
+        slave_group group = index == master_node_index()
+            ? slave_group { .upstream = master_node_index(), .first = 0, .last = slaves_count() }
+            : group_of(index - first_slave_index());
+
+        array<u32> nodes(group.last - group.first);
+        std::iota(std::begin(nodes), std::end(nodes), first_slave_index() + group.first);
+        return nodes;
+    }
+
+    // Index of a computing rank's chunk
+    u32 computing_position(u32 index) const noexcept
+    {
+        if (index == master_node_index()) {
+            return 0;
+        }
+
+        return index - first_slave_index() + (roles_.master_computes ? 1 : 0);
+    }
+
+    // Computing ranks in rank order, chunk i belongs to the i-th of them
+    array<u32> computing_node_indexes() const noexcept
+    {
+        array<u32> nodes;
+        if (roles_.master_computes) {
+            nodes.push_back(master_node_index());
+        }
+
+        array<u32> slaves = slaves_node_indexes();
+        nodes.insert(nodes.end(), slaves.begin(), slaves.end());
+        return nodes;
+    }
+
 private:
-    int node_index_;
-    int nodes_count_;
+    // Slaves from first to last by their position, reporting to upstream
+    struct slave_group {
+        u32 upstream;
+        u32 first;
+        u32 last;
+    };
+
+    u32 first_slave_index() const noexcept
+    {
+        return roles_.frontend ? 2 : 1;
+    }
+
+    u32 slaves_count() const noexcept
+    {
+        return nodes_count_ > first_slave_index() ? nodes_count_ - first_slave_index() : 0;
+    }
+
+    array<slave_group> split(u32 upstream, u32 first, u32 last) const noexcept
+    {
+        u32 count = last - first;
+        u32 parts = roles_.group_size == 0 ? count : std::min(roles_.group_size, count);
+
+        array<slave_group> groups;
+        for (u32 part = 0; part < parts; ++part) {
+            groups.push_back(slave_group { .upstream = upstream,
+                                           .first    = first + count * part / parts,
+                                           .last     = first + count * (part + 1) / parts });
+        }
+        return groups;
+    }
+
+    // Walks down from the master to the group the slave at position leads
+    slave_group group_of(u32 position) const noexcept
+    {
+        array<slave_group> groups = split(master_node_index(), 0, slaves_count());
+
+        while (true) {
+            slave_group group = *std::find_if(
+                groups.begin(), groups.end(), [position](const slave_group& g) { return position < g.last; });
+
+            if (group.first == position) {
+                return group;
+            }
+
+            groups = split(first_slave_index() + group.first, group.first + 1, group.last);
+        }
+    }
+
+    u32 node_index_;
+    u32 nodes_count_;
+    node_roles roles_;
 };
 
 }
@@ -1,98 +1,259 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstring>
 #include <iterator>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
 
 #include "fmt/format.h"
 
+#include "chunks.hpp"
 #include "ev_loop.hpp"
 #include "logging.hpp"
+#include "memory_tracking.hpp"
+#include "transport_backend.hpp"
 #include "types.hpp"
 
 namespace bh {
 
-class cluster_transport {
+struct transport_state;
+
+// Messages whose wire format is their own object representation. They are sent
+// from and received into the message itself, parce and serialize are skipped.
+template <typename Message>
+concept zero_copy_message = std::is_trivially_copyable_v<Message> && Message::zero_copy;
+
+// Typed messages for one node, packed back to back into a single frame. The receiving
+// transport unpacks it and dispatches every message as if it came on its own.
+class message_batch {
 public:
-    cluster_transport() = default;
+    // Frames travel with this type, no message may use it
+    static constexpr u32 frame_type = 0;
 
-    cluster_transport(const cluster_transport&) = delete;
-    cluster_transport(cluster_transport&&)      = delete;
+    // Precedes every message, which stays as aligned as the frame is for parce
+    struct alignas(std::max_align_t) record {
+        u32 type;
+        u32 size;
+    };
 
-    template <typename Message>
-    void poll_message(u32 node, task_t<unit, Message> handler, Message recv_msg, bool recurring = false)
+    static constexpr size_t padded(size_t size)
     {
-        if (can_recive(node, std::to_underlying(recv_msg.msg_type))) {
-            size_t size = msg_size(node, std::to_underlying(recv_msg.msg_type));
-            array<std::byte> buffer(size);
+        return (size + alignof(record) - 1) / alignof(record) * alignof(record);
+    }
 
-            receive(buffer.data(), size, node, std::to_underlying(recv_msg.msg_type));
-            recv_msg.parce(buffer.data());
+    template <typename Message>
+    void add(Message msg)
+    {
+        size_t size   = message_size(msg);
+        size_t offset = frame_.size();
+        frame_.resize(offset + sizeof(record) + padded(size));
 
-            handler(recv_msg);
-            if (recurring) {
-                pushToEvLoop<unit>([this, node, handler = std::move(handler), recv_msg, recurring](unit) -> unit {
-                    poll_message(node, std::move(handler), recv_msg, recurring);
+        record head { .type = std::to_underlying(msg.msg_type), .size = static_cast<u32>(size) };
+        std::memcpy(frame_.data() + offset, &head, sizeof(record));
 
-                    return unit();
-                });
-            }
+        std::byte* payload = frame_.data() + offset + sizeof(record);
+        if constexpr (zero_copy_message<Message>) {
+            std::memcpy(payload, &msg, sizeof(Message));
         } else {
-            pushToEvLoop<unit>([this, node, handler = std::move(handler), recv_msg, recurring](unit) -> unit {
-                poll_message(node, std::move(handler), recv_msg, recurring);
+            msg.serialize(payload);
+        }
+        ++count_;
+    }
 
-                return unit();
-            });
+    // Keeps the capacity, so a batch refilled every step does not allocate
+    void clear()
+    {
+        frame_.clear();
+        count_ = 0;
+    }
+
+    bool empty() const
+    {
+        return count_ == 0;
+    }
+
+    u32 count() const
+    {
+        return count_;
+    }
+
+    const tracked_array<std::byte, memory_tag::transport>& frame() const
+    {
+        return frame_;
+    }
+
+private:
+    template <typename Message>
+    static size_t message_size(Message& msg)
+    {
+        if constexpr (zero_copy_message<Message>) {
+            return sizeof(Message);
+        } else {
+            return msg.size();
         }
     }
 
+    tracked_array<std::byte, memory_tag::transport> frame_;
+    u32 count_ { 0 };
+};
+
+// The message structs of an application. Their types index the handler table of
+// cluster_transport, so they have to be distinct, and small for the table to be.
+template <typename... Messages>
+struct message_registry {
+    static constexpr u32 table_size = std::max({ 0u, (std::to_underlying(Messages::msg_type) + 1)... });
+
+    static constexpr bool distinct()
+    {
+        std::array<u32, sizeof...(Messages)> types { std::to_underlying(Messages::msg_type)... };
+        std::sort(types.begin(), types.end());
+        return std::adjacent_find(types.begin(), types.end()) == types.end();
+    }
+
+    static_assert(distinct(), "Two messages of the registry share a type");
+    static_assert(((std::to_underlying(Messages::msg_type) != message_batch::frame_type) && ...),
+        "A message of the registry uses the type of batch frames");
+};
+
+// Registers itself with the event loop, which drives pending handlers and
+// non-blocking requests. The backend moves the bytes.
+class cluster_transport : public event_source {
+public:
+    // Staging buffers are accounted to memory_tag::transport
+    using buffer_t = tracked_array<std::byte, memory_tag::transport>;
+
+    // The handler table starts with message_types slots, message_registry::table_size
+    explicit cluster_transport(std::unique_ptr<transport_backend> backend, u32 message_types = 0);
+    ~cluster_transport();
+
+    cluster_transport(const cluster_transport&) = delete;
+    cluster_transport(cluster_transport&&)      = delete;
+
+    // Probes once for any message and tests all requests in flight at once
+    bool progress() override;
+    bool waiting() const override;
+
+    u32 rank() const
+    {
+        return backend_->rank();
+    }
+
+    u32 ranks() const
+    {
+        return backend_->ranks();
+    }
+
+    // The handler runs from the event loop once the message has arrived. Recurring
+    // handlers keep waiting for the next one. Handlers of the same node and type run
+    // in the order they were added, one per message.
     template <typename Message>
     void add_handler(u32 node, task_t<unit, Message> handler, Message recv_message, bool recurring = false)
     {
-        pushToEvLoop<unit>([this, node, handler = std::move(handler), recv_message, recurring](unit) -> unit {
-            poll_message(node, std::move(handler), recv_message, recurring);
+        add_probe(pending_probe {
+            .node    = node,
+            .msg_id  = std::to_underlying(recv_message.msg_type),
+            .receive = [this, node, handler = std::move(handler), recv_message, recurring](unit) mutable -> bool {
+                take_message(node, recv_message);
+                handler(recv_message);
 
-            return unit();
-        });
+                return recurring;
+            } });
+    }
+
+    // Resolves from the event loop once the message has arrived, co_await-able
+    template <typename Message>
+    future<Message> receive(u32 node, Message recv_message = Message {})
+    {
+        auto [fut, prom] = create_futue_promice_pair<Message>();
+        add_handler<Message>(
+            node,
+            [prom = std::move(prom)](Message msg) mutable -> unit {
+                prom.resolve(std::move(msg));
+                return unit();
+            },
+            recv_message);
+        return std::move(fut);
+    }
+
+    // Blocks until the message arrives, on its own or in a batch
+    template <typename Message>
+    void receive_message(u32 node, Message& recv_msg)
+    {
+        wait_message(node, std::to_underlying(recv_msg.msg_type));
+        take_message(node, recv_msg);
     }
 
     template <typename Message>
     void send_message(u32 node, Message msg)
     {
-        array<std::byte> data(msg.size());
-        msg.serialize(data.data());
-        send(data.data(), msg.size(), node, std::to_underlying(msg.msg_type));
+        if constexpr (zero_copy_message<Message>) {
+            send(&msg, sizeof(Message), node, std::to_underlying(msg.msg_type));
+        } else {
+            buffer_t buffer = acquire_buffer(msg.size());
+            msg.serialize(buffer.data());
+            send(buffer.data(), buffer.size(), node, std::to_underlying(msg.msg_type));
+            release_buffer(std::move(buffer));
+        }
     }
 
-    template <typename T>
+    // Queues the message for the next flush(), which sends everything queued for a
+    // node as one batch. Types sent this way should always be, or their order is lost.
+    template <typename Message>
+    void post_message(u32 node, Message msg)
+    {
+        if (node >= posted_.size()) {
+            posted_.resize(node + 1);
+        }
+        posted_[node].add(std::move(msg));
+    }
+
+    void flush();
+
+    // A batch of one goes as its message alone
+    void send_batch(u32 node, const message_batch& batch);
+
+    // The batch must stay alive and untouched until the future resolves
+    future<unit> send_batch_async(u32 node, const message_batch& batch);
+
+    // Source and type of a message waiting on the wire, false if there is none
+    bool probe(u32& node, u32& type)
+    {
+        return backend_->probe_any(node, type);
+    }
+
+    template <typename T, typename Container = array<T>>
         requires(std::is_trivially_copyable_v<T>)
-    void send_array(const array<T>& msg, u32 node, u32 msg_id)
+    void send_array(const Container& msg, u32 node, u32 msg_id)
     {
         send((void*)msg.data(), msg.size() * sizeof(T), node, msg_id);
     }
 
-    template <typename T>
+    template <typename T, typename Container = array<T>>
         requires(std::is_trivially_copyable_v<T>)
-    array<T> receive_array(u32 node, u32 msg_id)
+    Container receive_array(u32 node, u32 msg_id)
     {
         u32 count = msg_size(node, msg_id) / sizeof(T);
-        array<T> msg(count);
+        Container msg(count);
         receive(msg.data(), count * sizeof(T), node, msg_id);
         return msg;
     }
 
-    template <typename T>
+    template <typename T, std::contiguous_iterator Iterator>
         requires(std::is_trivially_copyable_v<T>)
-    void send_array(array<T>::iterator begin, array<T>::iterator end, u32 node, u32 msg_id)
+    void send_array(Iterator begin, Iterator end, u32 node, u32 msg_id)
     {
         send(&(*begin), std::distance(begin, end) * sizeof(T), node, msg_id);
     }
 
-    template <typename T>
+    template <typename T, std::contiguous_iterator Iterator>
         requires(std::is_trivially_copyable_v<T>)
-    void receive_array(array<T>::iterator begin, array<T>::iterator end, u32 node, u32 msg_id)
+    void receive_array(Iterator begin, Iterator end, u32 node, u32 msg_id)
     {
         u32 count = msg_size(node, msg_id) / sizeof(T);
         if (std::distance(begin, end) != count) {
@@ -104,11 +265,170 @@ public:
         receive(&(*begin), count * sizeof(T), node, msg_id);
     }
 
+    // Non-blocking counterparts of send_array/receive_array. Requests are tested by
+    // the event loop, which resolves the future on completion. The range must stay
+    // alive and untouched until then.
+    template <typename T, std::contiguous_iterator Iterator>
+        requires(std::is_trivially_copyable_v<T>)
+    future<unit> send_array_async(Iterator begin, Iterator end, u32 node, u32 msg_id)
+    {
+        return start_send(&(*begin), std::distance(begin, end) * sizeof(T), node, msg_id);
+    }
+
+    template <typename T, std::contiguous_iterator Iterator>
+        requires(std::is_trivially_copyable_v<T>)
+    future<unit> receive_array_async(Iterator begin, Iterator end, u32 node, u32 msg_id)
+    {
+        return start_receive(&(*begin), std::distance(begin, end) * sizeof(T), node, msg_id);
+    }
+
+    // Collective over all ranks. Members form the group allgather_array runs on,
+    // ordered by rank.
+    void create_compute_group(bool member);
+
+    // Collective over the compute group, null when its members can not share memory
+    std::unique_ptr<host_group> create_host_group();
+
+    // Member i of the compute group owns data[chunks[i].begin, chunks[i].end).
+    // Every member ends up with all chunks, in place.
+    template <typename T, typename Container>
+        requires(std::is_trivially_copyable_v<T>)
+    void allgather_array(Container& data, const array<chunk>& chunks)
+    {
+        array<int> counts;
+        array<int> offsets;
+        chunk_bytes<T>(chunks, counts, offsets);
+
+        allgather(data.data(), counts, offsets);
+    }
+
+    // Like allgather_array() among the leaders of the hosts, host i owns chunks[i]
+    template <typename T, typename Container>
+        requires(std::is_trivially_copyable_v<T>)
+    static void allgather_leaders_array(host_group& host, Container& data, const array<chunk>& chunks)
+    {
+        array<int> counts;
+        array<int> offsets;
+        chunk_bytes<T>(chunks, counts, offsets);
+
+        host.allgather_leaders(data.data(), counts, offsets);
+    }
+
 private:
+    template <typename T>
+    static void chunk_bytes(const array<chunk>& chunks, array<int>& counts, array<int>& offsets)
+    {
+        counts.resize(chunks.size());
+        offsets.resize(chunks.size());
+
+        for (u32 i = 0; i < chunks.size(); ++i) {
+            counts[i]  = (chunks[i].end - chunks[i].begin) * sizeof(T);
+            offsets[i] = chunks[i].begin * sizeof(T);
+        }
+    }
+
+    // Staging buffers keep their capacity between messages, so the steady state
+    // loop does not allocate
+    buffer_t acquire_buffer(size_t size)
+    {
+        if (buffer_pool_.empty()) {
+            return buffer_t(size);
+        }
+
+        buffer_t buffer = std::move(buffer_pool_.back());
+        buffer_pool_.pop_back();
+        buffer.resize(size);
+        return buffer;
+    }
+
+    void release_buffer(buffer_t buffer)
+    {
+        buffer_pool_.push_back(std::move(buffer));
+    }
+
+    // Reads the message, unpacked or from the wire, which has to be there already
+    template <typename Message>
+    void take_message(u32 node, Message& recv_msg)
+    {
+        u32 type = std::to_underlying(recv_msg.msg_type);
+
+        buffer_t bytes;
+        if (!take_unpacked(node, type, bytes)) {
+            size_t size = msg_size(node, type);
+
+            if constexpr (zero_copy_message<Message>) {
+                check_size<Message>(size);
+                receive(&recv_msg, size, node, type);
+                return;
+            }
+
+            bytes = acquire_buffer(size);
+            receive(bytes.data(), size, node, type);
+        }
+
+        if constexpr (zero_copy_message<Message>) {
+            check_size<Message>(bytes.size());
+            std::memcpy(&recv_msg, bytes.data(), sizeof(Message));
+        } else {
+            recv_msg.parce(bytes.data());
+        }
+        release_buffer(std::move(bytes));
+    }
+
+    template <typename Message>
+    static void check_size(size_t size)
+    {
+        if (size != sizeof(Message)) {
+            throw std::runtime_error(fmt::format(
+                "Recived wrong size in cluster_transport::receive_message(): recv={}, expected={}",
+                size,
+                sizeof(Message)));
+        }
+    }
+
+    // Message of a batch no handler took yet
+    struct unpacked_message {
+        u32 node;
+        u32 type;
+        buffer_t bytes;
+    };
+
+    struct pending_probe {
+        u32 node;
+        u32 msg_id;
+        // Receives the message and runs the handler, true to keep waiting for the next one
+        task_t<bool, unit> receive;
+    };
+
+    void add_probe(pending_probe probe);
+    bool receive_messages();
+    void unpack_batch(u32 node);
+    bool deliver_unpacked();
+    bool take_unpacked(u32 node, u32 type, buffer_t& bytes);
+    void wait_message(u32 node, u32 type);
+    bool dispatch(u32 node, u32 type);
+    std::optional<size_t> find_handler(u32 node, u32 type) const;
+    bool probe_each();
+    void run_probe(u32 type, size_t index);
+    bool complete_requests();
+    future<unit> start_send(void* buff, u32 size, u32 node, u32 type);
+    future<unit> start_receive(void* buff, u32 size, u32 node, u32 type);
+    void allgather(void* buff, const array<int>& counts, const array<int>& offsets);
     void send(void* buff, u32 size, u32 node, u32 type);
     u32 msg_size(u32 node, u32 type);
     void receive(void* buff, u32 size, u32 node, u32 type);
     bool can_recive(u32 node, u32 msg_id);
+
+    std::unique_ptr<transport_backend> backend_;
+    std::unique_ptr<transport_state> state_;
+    array<buffer_t> buffer_pool_;
+    // Indexed by message type, in the order the handlers were added
+    array<array<pending_probe>> handlers_;
+    u32 handler_count_ { 0 };
+    // In the order they were unpacked
+    array<unpacked_message> unpacked_;
+    // Indexed by node, sent by flush()
+    array<message_batch> posted_;
 };
 
 }
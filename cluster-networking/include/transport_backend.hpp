@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+
+#include "types.hpp"
+
+namespace bh {
+
+// Non-blocking operation reported done by transport_backend::complete()
+struct completion {
+    u32 id;
+    // Bytes received, unused for sends
+    u32 size;
+};
+
+// Compute group members running on one host, which share memory. Members are
+// ranked in compute group order, rank 0 leads the host. Hosts are numbered in
+// the same order.
+class host_group {
+public:
+    virtual ~host_group() = default;
+
+    virtual u32 rank() const = 0;
+    virtual u32 size() const = 0;
+    virtual u32 host() const = 0;
+    // Compute group members of every host
+    virtual const array<u32>& host_sizes() const = 0;
+
+    // Collective over the host. Memory all members read and write in place, the
+    // same bytes for each of them. Valid until released, also collectively.
+    virtual std::span<std::byte> allocate(size_t bytes) = 0;
+    virtual void release(std::span<std::byte> memory) = 0;
+    // Writes to shared memory before the barrier are seen by every member after it
+    virtual void barrier() = 0;
+    // Collective over the leaders, like transport_backend::allgather() with host i
+    // contributing counts[i] bytes at offsets[i]
+    virtual void allgather_leaders(void* buff, const array<int>& counts, const array<int>& offsets) = 0;
+};
+
+// Moves tagged byte messages between ranks. cluster_transport builds messages,
+// handlers and futures on top. Messages from one rank with one type arrive in
+// the order they were sent.
+class transport_backend {
+public:
+    virtual ~transport_backend() = default;
+
+    virtual u32 rank() const  = 0;
+    virtual u32 ranks() const = 0;
+
+    virtual void send(const void* buff, u32 size, u32 node, u32 type) = 0;
+    // Size of the next message of the type from the node, blocks until there is one
+    virtual u32 msg_size(u32 node, u32 type) = 0;
+    virtual bool can_receive(u32 node, u32 type) = 0;
+    // Source and type of a message nobody received yet, false if there is none. Which
+    // one, when several arrived, is up to the backend.
+    virtual bool probe_any(u32& node, u32& type) = 0;
+    virtual void receive(void* buff, u32 size, u32 node, u32 type) = 0;
+
+    // The buffer has to stay alive and untouched until complete() reports the id
+    virtual u32 start_send(const void* buff, u32 size, u32 node, u32 type)  = 0;
+    virtual u32 start_receive(void* buff, u32 size, u32 node, u32 type) = 0;
+    // Appends the operations that finished since the last call, their ids are reused afterwards
+    virtual void complete(array<completion>& completed) = 0;
+
+    // Collective over all ranks. Members form the group allgather() runs on,
+    // ordered by rank. The defaults are built from point to point messages.
+    virtual void create_compute_group(bool member);
+    // Member i contributes counts[i] bytes at offsets[i], every member ends up with all of them
+    virtual void allgather(void* buff, const array<int>& counts, const array<int>& offsets);
+    // Collective over the compute group. Null on every member when the backend can
+    // not share memory, or the hosts' members are not contiguous in the group.
+    virtual std::unique_ptr<host_group> create_host_group();
+
+protected:
+    // Types above every message type, used by the default collectives
+    static constexpr u32 group_type     = 0xFFFF0000;
+    static constexpr u32 allgather_type = 0xFFFF0001;
+
+private:
+    array<u32> compute_group_;
+    bool in_compute_group_ { false };
+};
+
+// Ranks are the processes started by mpirun
+std::unique_ptr<transport_backend> make_mpi_backend(int& argc, char**& argv);
+
+// Ranks are threads of this process, one backend per rank
+array<std::unique_ptr<transport_backend>> make_local_backends(u32 ranks);
+
+// Ranks are processes on this host sharing a POSIX shared memory segment, with a
+// ring buffer per pair of ranks. Forks ranks - 1 children and returns the backend
+// of the calling process, rank 0 in the parent. Rank 0 waits for the children
+// when its backend is destroyed.
+std::unique_ptr<transport_backend> launch_shm_backend(u32 ranks, u32 ring_capacity);
+
+}
@@ -0,0 +1,199 @@
+#include "transport_backend.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+#include "message_inbox.hpp"
+
+namespace bh {
+
+namespace {
+
+    // Inboxes of all ranks of the process, senders copy straight into the receiver's
+    struct local_fabric {
+        struct mailbox {
+            explicit mailbox(u32 ranks)
+                : inbox(ranks)
+            {
+            }
+
+            std::mutex mutex;
+            std::condition_variable arrived;
+            message_inbox inbox;
+        };
+
+        array<std::unique_ptr<mailbox>> mailboxes;
+    };
+
+    class local_backend : public transport_backend {
+    public:
+        local_backend(std::shared_ptr<local_fabric> fabric, u32 rank)
+            : fabric_(std::move(fabric))
+            , rank_(rank)
+        {
+        }
+
+        u32 rank() const override
+        {
+            return rank_;
+        }
+
+        u32 ranks() const override
+        {
+            return fabric_->mailboxes.size();
+        }
+
+        void send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            const std::byte* bytes = static_cast<const std::byte*>(buff);
+            local_fabric::mailbox& box = *fabric_->mailboxes[node];
+
+            {
+                std::lock_guard lock(box.mutex);
+                box.inbox.push(rank_, type, message_inbox::bytes_t(bytes, bytes + size));
+            }
+            box.arrived.notify_all();
+        }
+
+        u32 msg_size(u32 node, u32 type) override
+        {
+            local_fabric::mailbox& box = own();
+            std::unique_lock lock(box.mutex);
+
+            message_inbox::message* msg;
+            box.arrived.wait(lock, [&] { return (msg = box.inbox.find(node, type)) != nullptr; });
+
+            return msg->bytes.size();
+        }
+
+        bool can_receive(u32 node, u32 type) override
+        {
+            local_fabric::mailbox& box = own();
+            std::lock_guard lock(box.mutex);
+
+            return box.inbox.find(node, type) != nullptr;
+        }
+
+        bool probe_any(u32& node, u32& type) override
+        {
+            local_fabric::mailbox& box = own();
+            std::lock_guard lock(box.mutex);
+
+            return box.inbox.front(node, type);
+        }
+
+        void receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            local_fabric::mailbox& box = own();
+            std::unique_lock lock(box.mutex);
+
+            message_inbox::message* msg;
+            box.arrived.wait(lock, [&] { return (msg = box.inbox.find(node, type)) != nullptr; });
+
+            take(box, msg, buff, size, node);
+        }
+
+        // Sends are buffered by the receiver, so they complete right away
+        u32 start_send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            send(buff, size, node, type);
+
+            u32 id = new_id();
+            done_.push_back(completion { .id = id, .size = 0 });
+            return id;
+        }
+
+        u32 start_receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            u32 id = new_id();
+            pending_.push_back(
+                pending_receive { .id = id, .buff = buff, .size = size, .node = node, .type = type });
+            return id;
+        }
+
+        void complete(array<completion>& completed) override
+        {
+            if (!pending_.empty()) {
+                local_fabric::mailbox& box = own();
+                std::lock_guard lock(box.mutex);
+
+                // Oldest first, receives of the same type from the same rank match in order
+                std::erase_if(pending_, [&](const pending_receive& pending) {
+                    message_inbox::message* msg = box.inbox.find(pending.node, pending.type);
+                    if (msg == nullptr) {
+                        return false;
+                    }
+
+                    done_.push_back(completion { .id = pending.id, .size = static_cast<u32>(msg->bytes.size()) });
+                    take(box, msg, pending.buff, pending.size, pending.node);
+                    return true;
+                });
+            }
+
+            // Reported ids are handed out again
+            for (const completion& done : done_) {
+                free_ids_.push_back(done.id);
+            }
+            completed.insert(completed.end(), done_.begin(), done_.end());
+            done_.clear();
+        }
+
+    private:
+        struct pending_receive {
+            u32 id;
+            void* buff;
+            u32 size;
+            u32 node;
+            u32 type;
+        };
+
+        u32 new_id()
+        {
+            if (free_ids_.empty()) {
+                return next_id_++;
+            }
+
+            u32 id = free_ids_.back();
+            free_ids_.pop_back();
+            return id;
+        }
+
+        local_fabric::mailbox& own()
+        {
+            return *fabric_->mailboxes[rank_];
+        }
+
+        // A size mismatch is reported by the caller, only what fits is copied
+        static void take(local_fabric::mailbox& box, message_inbox::message* msg, void* buff, u32 size, u32 node)
+        {
+            std::memcpy(buff, msg->bytes.data(), std::min<size_t>(size, msg->bytes.size()));
+            box.inbox.erase(node, msg);
+        }
+
+        std::shared_ptr<local_fabric> fabric_;
+        u32 rank_;
+        u32 next_id_ { 0 };
+        array<u32> free_ids_;
+        array<completion> done_;
+        array<pending_receive> pending_;
+    };
+
+}
+
+array<std::unique_ptr<transport_backend>> make_local_backends(u32 ranks)
+{
+    auto fabric = std::make_shared<local_fabric>();
+    for (u32 i = 0; i < ranks; ++i) {
+        fabric->mailboxes.push_back(std::make_unique<local_fabric::mailbox>(ranks));
+    }
+
+    array<std::unique_ptr<transport_backend>> backends;
+    for (u32 i = 0; i < ranks; ++i) {
+        backends.push_back(std::make_unique<local_backend>(fabric, i));
+    }
+    return backends;
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+
+#include "memory_tracking.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+// Messages that arrived before anyone asked for them, kept per source in arrival
+// order. Shared by the backends that match messages themselves.
+class message_inbox {
+public:
+    using bytes_t = tracked_array<std::byte, memory_tag::transport>;
+
+    struct message {
+        u32 type;
+        bytes_t bytes;
+    };
+
+    explicit message_inbox(u32 ranks)
+        : sources_(ranks)
+    {
+    }
+
+    void push(u32 node, u32 type, bytes_t bytes)
+    {
+        sources_[node].push_back(message { .type = type, .bytes = std::move(bytes) });
+    }
+
+    // Oldest message of the type from the node, null if there is none
+    message* find(u32 node, u32 type)
+    {
+        for (message& msg : sources_[node]) {
+            if (msg.type == type) {
+                return &msg;
+            }
+        }
+        return nullptr;
+    }
+
+    // Source and type of the oldest message of the first source with any, false if there is none
+    bool front(u32& node, u32& type) const
+    {
+        for (u32 source = 0; source < sources_.size(); ++source) {
+            if (!sources_[source].empty()) {
+                node = source;
+                type = sources_[source].front().type;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Removes a message returned by find()
+    void erase(u32 node, message* msg)
+    {
+        std::deque<message>& source = sources_[node];
+        source.erase(std::find_if(source.begin(), source.end(), [msg](const message& other) { return &other == msg; }));
+    }
+
+private:
+    array<std::deque<message>> sources_;
+};
+
+}
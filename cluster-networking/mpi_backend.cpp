@@ -0,0 +1,351 @@
+#include "transport_backend.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "mpi.hpp"
+
+namespace bh {
+
+namespace {
+
+    // Windows come from MPI_Win_allocate_shared and stay locked for their whole
+    // lifetime, barrier() synchronizes them all
+    class mpi_host_group : public host_group {
+    public:
+        mpi_host_group(MPI_Comm host, MPI_Comm leaders, u32 index, array<u32> sizes)
+            : host_(host)
+            , leaders_(leaders)
+            , index_(index)
+            , sizes_(std::move(sizes))
+        {
+            int rank;
+            int size;
+            MPI_Comm_rank(host_, &rank);
+            MPI_Comm_size(host_, &size);
+            rank_ = rank;
+            size_ = size;
+        }
+
+        ~mpi_host_group() override
+        {
+            for (window& shared : windows_) {
+                MPI_Win_unlock_all(shared.win);
+                MPI_Win_free(&shared.win);
+            }
+
+            if (leaders_ != MPI_COMM_NULL) {
+                MPI_Comm_free(&leaders_);
+            }
+            MPI_Comm_free(&host_);
+        }
+
+        u32 rank() const override
+        {
+            return rank_;
+        }
+
+        u32 size() const override
+        {
+            return size_;
+        }
+
+        u32 host() const override
+        {
+            return index_;
+        }
+
+        const array<u32>& host_sizes() const override
+        {
+            return sizes_;
+        }
+
+        // The leader allocates everything, the others map its part
+        std::span<std::byte> allocate(size_t bytes) override
+        {
+            window shared;
+            MPI_Win_allocate_shared(
+                rank_ == 0 ? bytes : 0, 1, MPI_INFO_NULL, host_, static_cast<void*>(&shared.base), &shared.win);
+
+            MPI_Aint size;
+            int disp_unit;
+            MPI_Win_shared_query(shared.win, 0, &size, &disp_unit, static_cast<void*>(&shared.base));
+            MPI_Win_lock_all(MPI_MODE_NOCHECK, shared.win);
+
+            windows_.push_back(shared);
+            return { shared.base, bytes };
+        }
+
+        void release(std::span<std::byte> memory) override
+        {
+            auto shared = std::find_if(windows_.begin(), windows_.end(), [&memory](const window& other) {
+                return other.base == memory.data();
+            });
+
+            MPI_Win_unlock_all(shared->win);
+            MPI_Win_free(&shared->win);
+            windows_.erase(shared);
+        }
+
+        void barrier() override
+        {
+            for (window& shared : windows_) {
+                MPI_Win_sync(shared.win);
+            }
+
+            MPI_Barrier(host_);
+
+            for (window& shared : windows_) {
+                MPI_Win_sync(shared.win);
+            }
+        }
+
+        void allgather_leaders(void* buff, const array<int>& counts, const array<int>& offsets) override
+        {
+            if (leaders_ == MPI_COMM_NULL) {
+                throw std::runtime_error("host_group::allgather_leaders() called by a member that does not lead");
+            }
+
+            MPI_Allgatherv(
+                MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, buff, counts.data(), offsets.data(), MPI_BYTE, leaders_);
+        }
+
+    private:
+        struct window {
+            MPI_Win win;
+            std::byte* base;
+        };
+
+        MPI_Comm host_;
+        MPI_Comm leaders_;
+        u32 index_;
+        array<u32> sizes_;
+        u32 rank_;
+        u32 size_;
+        array<window> windows_;
+    };
+
+    class mpi_backend : public transport_backend {
+    public:
+        mpi_backend(int& argc, char**& argv)
+        {
+            MPI_Init(&argc, &argv);
+
+            int rank;
+            int ranks;
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+            rank_  = rank;
+            ranks_ = ranks;
+        }
+
+        ~mpi_backend() override
+        {
+            if (compute_group_ != MPI_COMM_NULL) {
+                MPI_Comm_free(&compute_group_);
+            }
+
+            MPI_Finalize();
+        }
+
+        u32 rank() const override
+        {
+            return rank_;
+        }
+
+        u32 ranks() const override
+        {
+            return ranks_;
+        }
+
+        void send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            MPI_Send(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD);
+        }
+
+        u32 msg_size(u32 node, u32 type) override
+        {
+            MPI_Status status;
+            int buff_size;
+
+            MPI_Probe(node, type, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, MPI_BYTE, &buff_size);
+
+            return buff_size;
+        }
+
+        bool can_receive(u32 node, u32 type) override
+        {
+            MPI_Status status;
+            int flag;
+
+            MPI_Iprobe(node, type, MPI_COMM_WORLD, &flag, &status);
+
+            return static_cast<bool>(flag);
+        }
+
+        bool probe_any(u32& node, u32& type) override
+        {
+            MPI_Status status;
+            int flag;
+
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+            if (!flag) {
+                return false;
+            }
+
+            node = status.MPI_SOURCE;
+            type = status.MPI_TAG;
+            return true;
+        }
+
+        void receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            MPI_Recv(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+
+        u32 start_send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            MPI_Request request;
+            MPI_Isend(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD, &request);
+
+            return add(request, false);
+        }
+
+        u32 start_receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            MPI_Request request;
+            MPI_Irecv(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD, &request);
+
+            return add(request, true);
+        }
+
+        // Tests all requests in flight with one MPI_Testsome
+        void complete(array<completion>& completed) override
+        {
+            if (active_ == 0) {
+                return;
+            }
+
+            indices_.resize(handles_.size());
+            statuses_.resize(handles_.size());
+
+            int count;
+            MPI_Testsome(handles_.size(), handles_.data(), &count, indices_.data(), statuses_.data());
+            if (count == MPI_UNDEFINED) {
+                return;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                u32 id   = indices_[i];
+                int size = 0;
+                if (receives_[id]) {
+                    MPI_Get_count(&statuses_[i], MPI_BYTE, &size);
+                }
+
+                completed.push_back(completion { .id = id, .size = static_cast<u32>(size) });
+                free_requests_.push_back(id);
+                --active_;
+            }
+        }
+
+        void create_compute_group(bool member) override
+        {
+            MPI_Comm_split(MPI_COMM_WORLD, member ? 0 : MPI_UNDEFINED, rank_, &compute_group_);
+        }
+
+        void allgather(void* buff, const array<int>& counts, const array<int>& offsets) override
+        {
+            if (compute_group_ == MPI_COMM_NULL) {
+                throw std::runtime_error("transport_backend::allgather() called outside of the compute group");
+            }
+
+            MPI_Allgatherv(
+                MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, buff, counts.data(), offsets.data(), MPI_BYTE, compute_group_);
+        }
+
+        std::unique_ptr<host_group> create_host_group() override
+        {
+            if (compute_group_ == MPI_COMM_NULL) {
+                throw std::runtime_error("transport_backend::create_host_group() called outside of the compute group");
+            }
+
+            int rank;
+            int members;
+            MPI_Comm_rank(compute_group_, &rank);
+            MPI_Comm_size(compute_group_, &members);
+
+            MPI_Comm host;
+            MPI_Comm_split_type(compute_group_, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &host);
+
+            // The leader has the lowest rank of its host, every member learns everyone's leader
+            int leader = rank;
+            MPI_Bcast(&leader, 1, MPI_INT, 0, host);
+
+            array<int> leaders(members);
+            MPI_Allgather(&leader, 1, MPI_INT, leaders.data(), 1, MPI_INT, compute_group_);
+
+            // A host starts at its leader and runs until the next one
+            array<u32> sizes;
+            u32 index = 0;
+            for (int i = 0; i < members; ++i) {
+                if (leaders[i] == i) {
+                    sizes.push_back(0);
+                } else if (leaders[i] != leaders[i - 1]) {
+                    MPI_Comm_free(&host);
+                    return nullptr;
+                }
+
+                if (i == leader) {
+                    index = sizes.size() - 1;
+                }
+                ++sizes.back();
+            }
+
+            MPI_Comm leaders_group;
+            MPI_Comm_split(compute_group_, leader == rank ? 0 : MPI_UNDEFINED, rank, &leaders_group);
+
+            return std::make_unique<mpi_host_group>(host, leaders_group, index, std::move(sizes));
+        }
+
+    private:
+        // Ids index handles_, completed slots hold MPI_REQUEST_NULL and are reused
+        u32 add(MPI_Request request, bool receive)
+        {
+            ++active_;
+
+            if (free_requests_.empty()) {
+                handles_.push_back(request);
+                receives_.push_back(receive);
+                return handles_.size() - 1;
+            }
+
+            u32 id = free_requests_.back();
+            free_requests_.pop_back();
+            handles_[id]  = request;
+            receives_[id] = receive;
+            return id;
+        }
+
+        u32 rank_;
+        u32 ranks_;
+        MPI_Comm compute_group_ { MPI_COMM_NULL };
+
+        array<MPI_Request> handles_;
+        array<bool> receives_;
+        array<u32> free_requests_;
+        u32 active_ { 0 };
+
+        // Scratch space of complete()
+        array<int> indices_;
+        array<MPI_Status> statuses_;
+    };
+
+}
+
+std::unique_ptr<transport_backend> make_mpi_backend(int& argc, char**& argv)
+{
+    return std::make_unique<mpi_backend>(argc, argv);
+}
+
+}
@@ -0,0 +1,694 @@
+#include "transport_backend.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "fmt/format.h"
+
+#include "message_inbox.hpp"
+
+namespace bh {
+
+#ifdef __linux__
+namespace {
+
+    constexpr size_t cache_line = 64;
+    constexpr u32 yield_rounds  = 100;
+    // A sleeping rank wakes up this often to see if its peers are still alive
+    constexpr std::chrono::milliseconds liveness_interval { 100 };
+
+    [[noreturn]] void throw_errno(const char* call)
+    {
+        throw std::runtime_error(fmt::format("launch_shm_backend(): {} failed: {}", call, std::strerror(errno)));
+    }
+
+    // Bumped on every event a sleeping rank may care about. The futex is not
+    // process private, the word lives in the shared segment.
+    struct alignas(cache_line) doorbell {
+        std::atomic<u32> value;
+        std::atomic<u32> sleeping;
+
+        void ring()
+        {
+            value.fetch_add(1);
+            if (sleeping.load()) {
+                syscall(SYS_futex, &value, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+            }
+        }
+
+        // Returns once the value is no longer seen, either side of a ring() wins the race,
+        // or after the timeout. False on the timeout.
+        bool sleep(u32 seen, std::chrono::nanoseconds timeout)
+        {
+            timespec wait { .tv_sec  = static_cast<time_t>(timeout.count() / 1000000000),
+                            .tv_nsec = static_cast<long>(timeout.count() % 1000000000) };
+
+            sleeping.store(1);
+            long result    = syscall(SYS_futex, &value, FUTEX_WAIT, seen, &wait, nullptr, 0);
+            bool timed_out = result != 0 && errno == ETIMEDOUT;
+            sleeping.store(0);
+
+            return !timed_out;
+        }
+    };
+
+    // Single producer, single consumer byte stream. Head and tail count bytes ever
+    // written and read, the capacity is a power of two.
+    struct ring {
+        alignas(cache_line) std::atomic<u64> head;
+        alignas(cache_line) std::atomic<u64> tail;
+
+        std::byte* bytes()
+        {
+            return reinterpret_cast<std::byte*>(this + 1);
+        }
+
+        u32 write(const std::byte* data, u32 size, u32 capacity)
+        {
+            u64 at    = head.load(std::memory_order_relaxed);
+            u32 count = std::min<u64>(size, capacity - (at - tail.load(std::memory_order_acquire)));
+            u32 first = std::min<u32>(count, capacity - (at & (capacity - 1)));
+
+            std::memcpy(bytes() + (at & (capacity - 1)), data, first);
+            std::memcpy(bytes(), data + first, count - first);
+            head.store(at + count, std::memory_order_release);
+            return count;
+        }
+
+        u32 read(std::byte* data, u32 size, u32 capacity)
+        {
+            u64 at    = tail.load(std::memory_order_relaxed);
+            u32 count = std::min<u64>(size, head.load(std::memory_order_acquire) - at);
+            u32 first = std::min<u32>(count, capacity - (at & (capacity - 1)));
+
+            std::memcpy(data, bytes() + (at & (capacity - 1)), first);
+            std::memcpy(data + first, bytes(), count - first);
+            tail.store(at + count, std::memory_order_release);
+            return count;
+        }
+    };
+
+    // Header, one doorbell per rank, then a ring per ordered pair of ranks
+    struct segment {
+        segment(void* base, size_t size, u32 ranks, u32 capacity)
+            : base(static_cast<std::byte*>(base))
+            , size(size)
+            , ranks(ranks)
+            , capacity(capacity)
+        {
+        }
+
+        static size_t ring_stride(u32 capacity)
+        {
+            return sizeof(ring) + capacity;
+        }
+
+        static size_t bytes(u32 ranks, u32 capacity)
+        {
+            return cache_line + ranks * sizeof(doorbell) + size_t(ranks) * ranks * ring_stride(capacity);
+        }
+
+        doorbell& bell(u32 rank)
+        {
+            return reinterpret_cast<doorbell*>(base + cache_line)[rank];
+        }
+
+        ring& channel(u32 from, u32 to)
+        {
+            std::byte* rings = base + cache_line + ranks * sizeof(doorbell);
+            return *reinterpret_cast<ring*>(rings + (size_t(from) * ranks + to) * ring_stride(capacity));
+        }
+
+        std::byte* base;
+        size_t size;
+        u32 ranks;
+        u32 capacity;
+    };
+
+    // Every message is streamed as this header followed by the payload
+    struct wire_header {
+        u32 type;
+        u32 size;
+    };
+
+    class shm_backend : public transport_backend {
+    public:
+        // The parent is rank 0's process, children are only known to rank 0
+        shm_backend(segment seg, u32 rank, array<pid_t> children, pid_t parent)
+            : seg_(seg)
+            , rank_(rank)
+            , children_(std::move(children))
+            , parent_(parent)
+            , inbox_(seg.ranks)
+            , outgoing_(seg.ranks)
+            , incoming_(seg.ranks)
+        {
+        }
+
+        // Ranks waiting for one that failed never finish, reap_children() stops them
+        ~shm_backend() override
+        {
+            while (std::any_of(children_.begin(), children_.end(), [](pid_t child) { return child != 0; })) {
+                reap_children();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            munmap(seg_.base, seg_.size);
+        }
+
+        u32 rank() const override
+        {
+            return rank_;
+        }
+
+        u32 ranks() const override
+        {
+            return seg_.ranks;
+        }
+
+        void send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            enqueue(buff, size, node, type, std::nullopt);
+
+            // Outgoing messages leave in order, so this one is out once the queue is empty
+            wait_until([&] { return outgoing_[node].empty(); });
+        }
+
+        u32 msg_size(u32 node, u32 type) override
+        {
+            want_ = want { .node = node, .type = type };
+
+            u32 size;
+            wait_until([&] {
+                if (message_inbox::message* msg = inbox_.find(node, type)) {
+                    size = msg->bytes.size();
+                    return true;
+                }
+                if (parked(node, type)) {
+                    size = incoming_[node].header.size;
+                    return true;
+                }
+                return false;
+            });
+
+            want_.reset();
+            return size;
+        }
+
+        bool can_receive(u32 node, u32 type) override
+        {
+            want_ = want { .node = node, .type = type };
+            progress();
+            want_.reset();
+
+            return inbox_.find(node, type) != nullptr || parked(node, type);
+        }
+
+        // Nobody wants anything here, so whatever arrived is staged into the inbox
+        bool probe_any(u32& node, u32& type) override
+        {
+            progress();
+
+            return inbox_.front(node, type);
+        }
+
+        void receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            want_      = want { .node = node, .type = type };
+            delivered_ = false;
+
+            wait_until([&] {
+                // The next message of the type may already be parked behind the delivered one
+                if (delivered_) {
+                    return true;
+                }
+                if (message_inbox::message* msg = inbox_.find(node, type)) {
+                    take(msg, buff, size, node);
+                    return true;
+                }
+
+                // Streamed from the ring straight into the caller's buffer
+                incoming& in = incoming_[node];
+                if (parked(node, type)) {
+                    if (in.header.size == size) {
+                        in.state  = incoming::direct;
+                        in.target = static_cast<std::byte*>(buff);
+                    } else {
+                        stage(in);
+                    }
+                }
+                return false;
+            });
+
+            want_.reset();
+        }
+
+        // The buffer is streamed into the ring as space frees up
+        u32 start_send(const void* buff, u32 size, u32 node, u32 type) override
+        {
+            u32 id = new_id();
+            enqueue(buff, size, node, type, id);
+            progress();
+            return id;
+        }
+
+        u32 start_receive(void* buff, u32 size, u32 node, u32 type) override
+        {
+            u32 id = new_id();
+
+            if (message_inbox::message* msg = inbox_.find(node, type)) {
+                done_.push_back(completion { .id = id, .size = static_cast<u32>(msg->bytes.size()) });
+                take(msg, buff, size, node);
+                return id;
+            }
+
+            pending_.push_back(pending_receive {
+                .id = id, .buff = static_cast<std::byte*>(buff), .size = size, .node = node, .type = type });
+            return id;
+        }
+
+        void complete(array<completion>& completed) override
+        {
+            progress();
+
+            // Reported ids are handed out again
+            for (const completion& done : done_) {
+                free_ids_.push_back(done.id);
+            }
+            completed.insert(completed.end(), done_.begin(), done_.end());
+            done_.clear();
+        }
+
+    private:
+        struct want {
+            u32 node;
+            u32 type;
+        };
+
+        struct outgoing {
+            const std::byte* data;
+            wire_header header;
+            // Header and payload bytes already in the ring
+            u32 written;
+            std::optional<u32> id;
+        };
+
+        struct incoming {
+            enum kind {
+                // Reading the header
+                header_bytes,
+                // Header read, nobody asked for the message yet
+                parked,
+                // Payload goes to the buffer of a blocking receive
+                direct,
+                // Payload goes to the buffer of a non-blocking receive
+                pending,
+                // Payload is copied aside and kept in the inbox
+                staged,
+            };
+
+            kind state { header_bytes };
+            wire_header header;
+            u32 header_read { 0 };
+            std::byte* target { nullptr };
+            u32 received { 0 };
+            u32 id { 0 };
+            message_inbox::bytes_t staging;
+        };
+
+        struct pending_receive {
+            u32 id;
+            std::byte* buff;
+            u32 size;
+            u32 node;
+            u32 type;
+        };
+
+        u32 new_id()
+        {
+            if (free_ids_.empty()) {
+                return next_id_++;
+            }
+
+            u32 id = free_ids_.back();
+            free_ids_.pop_back();
+            return id;
+        }
+
+        bool parked(u32 node, u32 type) const
+        {
+            return incoming_[node].state == incoming::parked && incoming_[node].header.type == type;
+        }
+
+        void enqueue(const void* buff, u32 size, u32 node, u32 type, std::optional<u32> id)
+        {
+            outgoing_[node].push_back(outgoing {
+                .data    = static_cast<const std::byte*>(buff),
+                .header  = wire_header { .type = type, .size = size },
+                .written = 0,
+                .id      = id });
+        }
+
+        // Runs progress until the predicate holds. Yields for a while when nothing
+        // moves, the peer is likely about to answer, then sleeps on the doorbell.
+        template <typename Predicate>
+        void wait_until(Predicate predicate)
+        {
+            doorbell& bell = seg_.bell(rank_);
+
+            u32 idle = 0;
+            while (!predicate()) {
+                u32 seen = bell.value.load();
+                if (progress() || predicate()) {
+                    idle = 0;
+                    continue;
+                }
+                if (idle++ < yield_rounds) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if (!bell.sleep(seen, liveness_interval)) {
+                    check_peers();
+                }
+            }
+        }
+
+        // Throws instead of waiting forever for a rank that is gone
+        void check_peers()
+        {
+            if (rank_ != 0 && getppid() != parent_) {
+                throw std::runtime_error(fmt::format("shm backend: rank {}: rank 0 exited", rank_));
+            }
+
+            if (std::optional<u32> failed = reap_children()) {
+                throw std::runtime_error(fmt::format("shm backend: rank {} failed", *failed));
+            }
+        }
+
+        // Reaps the children that exited. Once one of them failed the others are killed,
+        // they may be waiting for it. Returns the rank of a failed child.
+        std::optional<u32> reap_children()
+        {
+            std::optional<u32> failed;
+
+            for (u32 i = 0; i < children_.size(); ++i) {
+                int status = 0;
+                if (children_[i] == 0 || waitpid(children_[i], &status, WNOHANG) != children_[i]) {
+                    continue;
+                }
+
+                children_[i] = 0;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    failed = failed.value_or(i + 1);
+                }
+            }
+
+            if (failed) {
+                for (pid_t child : children_) {
+                    if (child != 0) {
+                        kill(child, SIGKILL);
+                    }
+                }
+            }
+
+            return failed;
+        }
+
+        bool progress()
+        {
+            bool moved = false;
+
+            for (u32 node = 0; node < seg_.ranks; ++node) {
+                moved |= flush(node);
+                moved |= drain(node);
+            }
+
+            return moved;
+        }
+
+        // Writes queued messages to the node as far as the ring allows
+        bool flush(u32 node)
+        {
+            std::deque<outgoing>& queue = outgoing_[node];
+            ring& out                   = seg_.channel(rank_, node);
+
+            bool moved = false;
+            while (!queue.empty()) {
+                outgoing& msg = queue.front();
+                u32 total     = sizeof(wire_header) + msg.header.size;
+
+                u32 before = msg.written;
+                if (msg.written < sizeof(wire_header)) {
+                    const std::byte* header = reinterpret_cast<const std::byte*>(&msg.header);
+                    msg.written += out.write(header + msg.written, sizeof(wire_header) - msg.written, seg_.capacity);
+                }
+                if (msg.written >= sizeof(wire_header)) {
+                    u32 offset = msg.written - sizeof(wire_header);
+                    msg.written += out.write(msg.data + offset, msg.header.size - offset, seg_.capacity);
+                }
+
+                if (msg.written > before) {
+                    moved = true;
+                    seg_.bell(node).ring();
+                }
+
+                if (msg.written < total) {
+                    break;
+                }
+                if (msg.id) {
+                    done_.push_back(completion { .id = *msg.id, .size = 0 });
+                }
+                queue.pop_front();
+            }
+
+            return moved;
+        }
+
+        // Reads messages from the node into whoever wants them
+        bool drain(u32 node)
+        {
+            incoming& in = incoming_[node];
+            ring& from   = seg_.channel(node, rank_);
+
+            bool moved = false;
+            while (true) {
+                if (in.state == incoming::header_bytes) {
+                    std::byte* header = reinterpret_cast<std::byte*>(&in.header) + in.header_read;
+                    u32 read          = from.read(header, sizeof(wire_header) - in.header_read, seg_.capacity);
+                    if (read == 0) {
+                        break;
+                    }
+
+                    moved = true;
+                    seg_.bell(node).ring();
+                    in.header_read += read;
+                    if (in.header_read < sizeof(wire_header)) {
+                        break;
+                    }
+                    in.state = incoming::parked;
+                }
+
+                if (in.state == incoming::parked && !route(node, in)) {
+                    break;
+                }
+                if (in.received < in.header.size) {
+                    u32 read = from.read(in.target + in.received, in.header.size - in.received, seg_.capacity);
+                    if (read > 0) {
+                        moved = true;
+                        seg_.bell(node).ring();
+                    }
+                    in.received += read;
+                    if (in.received < in.header.size) {
+                        break;
+                    }
+                }
+
+                finish(node, in);
+            }
+
+            return moved;
+        }
+
+        // Picks where the payload of a parked message goes, false to leave it parked
+        bool route(u32 node, incoming& in)
+        {
+            auto pending = std::find_if(pending_.begin(), pending_.end(), [&](const pending_receive& receive) {
+                return receive.node == node && receive.type == in.header.type;
+            });
+
+            if (pending != pending_.end() && pending->size == in.header.size) {
+                in.state  = incoming::pending;
+                in.target = pending->buff;
+                in.id     = pending->id;
+                pending_.erase(pending);
+                return true;
+            }
+
+            // A blocking call asked for this one, it decides where the payload goes
+            if (pending == pending_.end() && want_ && want_->node == node && want_->type == in.header.type) {
+                return false;
+            }
+
+            stage(in);
+            return true;
+        }
+
+        // Copied aside so that the messages behind it are not held up
+        void stage(incoming& in)
+        {
+            in.state = incoming::staged;
+            in.staging.resize(in.header.size);
+            in.target = in.staging.data();
+        }
+
+        void finish(u32 node, incoming& in)
+        {
+            switch (in.state) {
+            case incoming::direct:
+                delivered_ = true;
+                break;
+            case incoming::pending:
+                done_.push_back(completion { .id = in.id, .size = in.header.size });
+                break;
+            case incoming::staged:
+                inbox_.push(node, in.header.type, std::move(in.staging));
+                in.staging = message_inbox::bytes_t();
+                match_pending(node);
+                break;
+            default:
+                break;
+            }
+
+            in.state       = incoming::header_bytes;
+            in.header_read = 0;
+            in.received    = 0;
+            in.target      = nullptr;
+        }
+
+        // Non-blocking receives whose message had to be staged, usually a size mismatch
+        void match_pending(u32 node)
+        {
+            std::erase_if(pending_, [&](const pending_receive& pending) {
+                if (pending.node != node) {
+                    return false;
+                }
+
+                message_inbox::message* msg = inbox_.find(node, pending.type);
+                if (msg == nullptr) {
+                    return false;
+                }
+
+                done_.push_back(completion { .id = pending.id, .size = static_cast<u32>(msg->bytes.size()) });
+                take(msg, pending.buff, pending.size, node);
+                return true;
+            });
+        }
+
+        // A size mismatch is reported by the caller, only what fits is copied
+        void take(message_inbox::message* msg, void* buff, u32 size, u32 node)
+        {
+            std::memcpy(buff, msg->bytes.data(), std::min<size_t>(size, msg->bytes.size()));
+            inbox_.erase(node, msg);
+        }
+
+        segment seg_;
+        u32 rank_;
+        // Zeroed once reaped
+        array<pid_t> children_;
+        pid_t parent_;
+
+        message_inbox inbox_;
+        array<std::deque<outgoing>> outgoing_;
+        array<incoming> incoming_;
+        array<pending_receive> pending_;
+        array<completion> done_;
+        u32 next_id_ { 0 };
+        array<u32> free_ids_;
+
+        std::optional<want> want_;
+        // Set once a direct message has landed in the buffer of receive()
+        bool delivered_ { false };
+    };
+
+}
+
+std::unique_ptr<transport_backend> launch_shm_backend(u32 ranks, u32 ring_capacity)
+{
+    u32 capacity = std::bit_ceil(std::max<u32>(ring_capacity, cache_line));
+    size_t size  = segment::bytes(ranks, capacity);
+
+    // Unlinked right away, the mapping is inherited by the children
+    std::string name = fmt::format("/bh-{}", getpid());
+    int fd           = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        throw_errno("shm_open");
+    }
+    shm_unlink(name.c_str());
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        throw_errno("ftruncate");
+    }
+
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        throw_errno("mmap");
+    }
+
+    segment seg(base, size, ranks, capacity);
+    for (u32 i = 0; i < ranks; ++i) {
+        new (&seg.bell(i)) doorbell {};
+        for (u32 j = 0; j < ranks; ++j) {
+            new (&seg.channel(i, j)) ring {};
+        }
+    }
+
+    // Buffered output would be written once by every process
+    std::fflush(nullptr);
+
+    pid_t parent = getpid();
+
+    array<pid_t> children;
+    for (u32 rank = 1; rank < ranks; ++rank) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw_errno("fork");
+        }
+        if (pid == 0) {
+            return std::make_unique<shm_backend>(seg, rank, array<pid_t>(), parent);
+        }
+        children.push_back(pid);
+    }
+
+    return std::make_unique<shm_backend>(seg, 0, std::move(children), parent);
+}
+
+#else
+std::unique_ptr<transport_backend> launch_shm_backend(u32, u32)
+{
+    throw std::runtime_error("launch_shm_backend(): shared memory backend is only available on Linux");
+}
+#endif
+
+}
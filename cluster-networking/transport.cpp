@@ -1,38 +1,378 @@
 #include "transport.hpp"
 
-#include "mpi.hpp"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <utility>
 
 namespace bh {
 
-void cluster_transport::send(void* buff, u32 size, u32 node, u32 type)
+namespace {
+
+    // What goes on the wire for a batch
+    struct wire_frame {
+        const std::byte* data;
+        u32 size;
+        u32 type;
+    };
+
+    wire_frame wire_frame_of(const message_batch& batch)
+    {
+        const auto& frame = batch.frame();
+        if (batch.count() != 1) {
+            return wire_frame { frame.data(), static_cast<u32>(frame.size()), message_batch::frame_type };
+        }
+
+        message_batch::record head;
+        std::memcpy(&head, frame.data(), sizeof(head));
+        return wire_frame { frame.data() + sizeof(head), head.size, head.type };
+    }
+
+}
+
+struct transport_state {
+    struct pending_request {
+        u32 size;
+        bool receive;
+        std::optional<promice<unit>> prom;
+    };
+
+    // Indexed by the ids the backend hands out
+    array<pending_request> requests;
+    u32 active { 0 };
+
+    // Scratch space of complete_requests()
+    array<completion> completed;
+    array<promice<unit>> resolved;
+
+    future<unit> add(u32 id, u32 size, bool receive)
+    {
+        auto [fut, prom] = create_futue_promice_pair<unit>();
+
+        if (id >= requests.size()) {
+            requests.resize(id + 1);
+        }
+        requests[id].size    = size;
+        requests[id].receive = receive;
+        requests[id].prom.emplace(std::move(prom));
+
+        ++active;
+        return std::move(fut);
+    }
+};
+
+cluster_transport::cluster_transport(std::unique_ptr<transport_backend> backend, u32 message_types)
+    : backend_(std::move(backend))
+    , state_(std::make_unique<transport_state>())
+    , handlers_(message_types)
 {
-    MPI_Send(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD);
+    g_event_loop.add_source(this);
 }
 
-u32 cluster_transport::msg_size(u32 node, u32 type)
+cluster_transport::~cluster_transport()
 {
-    MPI_Status status;
-    int buff_size;
+    g_event_loop.remove_source(this);
+}
 
-    MPI_Probe(node, type, MPI_COMM_WORLD, &status);
-    MPI_Get_count(&status, MPI_BYTE, &buff_size);
+bool cluster_transport::progress()
+{
+    bool completed = complete_requests();
+    bool received  = receive_messages();
 
-    return buff_size;
+    return completed || received;
 }
 
-bool cluster_transport::can_recive(u32 node, u32 msg_id)
+bool cluster_transport::waiting() const
+{
+    return handler_count_ > 0 || state_->active > 0;
+}
+
+void cluster_transport::add_probe(pending_probe probe)
+{
+    if (probe.msg_id >= handlers_.size()) {
+        handlers_.resize(probe.msg_id + 1);
+    }
+
+    handlers_[probe.msg_id].push_back(std::move(probe));
+    ++handler_count_;
+}
+
+// As many messages as there are handlers at most, so other sources get their turn
+bool cluster_transport::receive_messages()
 {
-    MPI_Status status;
-    int flag;
+    bool received = deliver_unpacked();
+
+    for (u32 polls = handler_count_; polls > 0 && !g_event_loop.stopped(); --polls) {
+        u32 node;
+        u32 type;
+        if (!backend_->probe_any(node, type)) {
+            break;
+        }
+
+        if (type == message_batch::frame_type) {
+            unpack_batch(node);
+            received = deliver_unpacked() || received;
+            continue;
+        }
 
-    MPI_Iprobe(node, msg_id, MPI_COMM_WORLD, &flag, &status);
+        // Waits for a blocking receive, the messages behind it may have handlers
+        if (!dispatch(node, type)) {
+            return probe_each() || received;
+        }
+        received = true;
+    }
 
-    return static_cast<bool>(flag);
+    return received;
+}
+
+bool cluster_transport::dispatch(u32 node, u32 type)
+{
+    std::optional<size_t> handler = find_handler(node, type);
+    if (!handler) {
+        return false;
+    }
+
+    run_probe(type, *handler);
+    return true;
+}
+
+// The first one added
+std::optional<size_t> cluster_transport::find_handler(u32 node, u32 type) const
+{
+    if (type >= handlers_.size()) {
+        return std::nullopt;
+    }
+
+    const array<pending_probe>& handlers = handlers_[type];
+    auto handler = std::find_if(
+        handlers.begin(), handlers.end(), [node](const pending_probe& probe) { return probe.node == node; });
+    if (handler == handlers.end()) {
+        return std::nullopt;
+    }
+
+    return handler - handlers.begin();
+}
+
+// Handlers added by handlers are appended and probed on the next call
+bool cluster_transport::probe_each()
+{
+    for (const array<pending_probe>& handlers : handlers_) {
+        for (const pending_probe& probe : handlers) {
+            if (can_recive(probe.node, message_batch::frame_type)) {
+                unpack_batch(probe.node);
+            }
+        }
+    }
+
+    bool received = deliver_unpacked();
+
+    for (u32 type = 0; type < handlers_.size(); ++type) {
+        size_t i = 0;
+        for (size_t probed = handlers_[type].size(); probed > 0 && !g_event_loop.stopped(); --probed) {
+            if (!can_recive(handlers_[type][i].node, type)) {
+                ++i;
+                continue;
+            }
+
+            run_probe(type, i);
+            received = true;
+        }
+    }
+
+    return received;
+}
+
+void cluster_transport::unpack_batch(u32 node)
+{
+    u32 size       = msg_size(node, message_batch::frame_type);
+    buffer_t frame = acquire_buffer(size);
+    receive(frame.data(), size, node, message_batch::frame_type);
+
+    for (size_t offset = 0; offset < size;) {
+        message_batch::record head;
+        std::memcpy(&head, frame.data() + offset, sizeof(head));
+        offset += sizeof(head);
+
+        buffer_t bytes = acquire_buffer(head.size);
+        std::memcpy(bytes.data(), frame.data() + offset, head.size);
+        offset += message_batch::padded(head.size);
+
+        unpacked_.push_back(unpacked_message { .node = node, .type = head.type, .bytes = std::move(bytes) });
+    }
+
+    release_buffer(std::move(frame));
+}
+
+// In order per node and type, a message waits while an earlier one of its kind has no handler
+bool cluster_transport::deliver_unpacked()
+{
+    bool delivered = false;
+    array<std::pair<u32, u32>> waiting;
+
+    for (size_t i = 0; i < unpacked_.size() && !g_event_loop.stopped();) {
+        std::pair<u32, u32> kind { unpacked_[i].node, unpacked_[i].type };
+        if (std::find(waiting.begin(), waiting.end(), kind) != waiting.end()) {
+            ++i;
+            continue;
+        }
+
+        std::optional<size_t> handler = find_handler(kind.first, kind.second);
+        if (!handler) {
+            waiting.push_back(kind);
+            ++i;
+            continue;
+        }
+
+        // Takes unpacked_[i], the first of its kind
+        run_probe(kind.second, *handler);
+        delivered = true;
+    }
+
+    return delivered;
+}
+
+bool cluster_transport::take_unpacked(u32 node, u32 type, buffer_t& bytes)
+{
+    auto message = std::find_if(unpacked_.begin(), unpacked_.end(), [node, type](const unpacked_message& msg) {
+        return msg.node == node && msg.type == type;
+    });
+    if (message == unpacked_.end()) {
+        return false;
+    }
+
+    bytes = std::move(message->bytes);
+    unpacked_.erase(message);
+    return true;
+}
+
+// The message may come on its own or in a batch, so both are polled
+void cluster_transport::wait_message(u32 node, u32 type)
+{
+    auto unpacked = [this, node, type]() {
+        return std::any_of(unpacked_.begin(), unpacked_.end(), [node, type](const unpacked_message& msg) {
+            return msg.node == node && msg.type == type;
+        });
+    };
+
+    while (!unpacked() && !can_recive(node, type)) {
+        if (can_recive(node, message_batch::frame_type)) {
+            unpack_batch(node);
+        }
+    }
+}
+
+void cluster_transport::flush()
+{
+    for (u32 node = 0; node < posted_.size(); ++node) {
+        if (!posted_[node].empty()) {
+            send_batch(node, posted_[node]);
+            posted_[node].clear();
+        }
+    }
+}
+
+void cluster_transport::send_batch(u32 node, const message_batch& batch)
+{
+    wire_frame wire = wire_frame_of(batch);
+    backend_->send(wire.data, wire.size, node, wire.type);
+}
+
+future<unit> cluster_transport::send_batch_async(u32 node, const message_batch& batch)
+{
+    wire_frame wire = wire_frame_of(batch);
+    return state_->add(backend_->start_send(wire.data, wire.size, node, wire.type), wire.size, false);
+}
+
+void cluster_transport::run_probe(u32 type, size_t index)
+{
+    pending_probe probe = std::move(handlers_[type][index]);
+    handlers_[type].erase(handlers_[type].begin() + index);
+    --handler_count_;
+
+    if (probe.receive(unit())) {
+        add_probe(std::move(probe));
+    }
+}
+
+bool cluster_transport::complete_requests()
+{
+    if (state_->active == 0) {
+        return false;
+    }
+
+    backend_->complete(state_->completed);
+    if (state_->completed.empty()) {
+        return false;
+    }
+
+    for (const completion& done : state_->completed) {
+        transport_state::pending_request& request = state_->requests[done.id];
+
+        if (request.receive && done.size != request.size) {
+            throw std::runtime_error(fmt::format(
+                "Recived wrong amount in cluster_transport::receive_array_async(): recv={}, expected={}",
+                done.size,
+                request.size));
+        }
+
+        state_->resolved.push_back(std::move(*request.prom));
+        request.prom.reset();
+        --state_->active;
+    }
+    state_->completed.clear();
+
+    // Continuations may start new requests, so they run once the bookkeeping is done
+    for (promice<unit>& prom : state_->resolved) {
+        prom.resolve(unit());
+    }
+    state_->resolved.clear();
+
+    return true;
+}
+
+void cluster_transport::create_compute_group(bool member)
+{
+    backend_->create_compute_group(member);
+}
+
+std::unique_ptr<host_group> cluster_transport::create_host_group()
+{
+    return backend_->create_host_group();
+}
+
+future<unit> cluster_transport::start_send(void* buff, u32 size, u32 node, u32 type)
+{
+    return state_->add(backend_->start_send(buff, size, node, type), size, false);
+}
+
+future<unit> cluster_transport::start_receive(void* buff, u32 size, u32 node, u32 type)
+{
+    return state_->add(backend_->start_receive(buff, size, node, type), size, true);
+}
+
+void cluster_transport::allgather(void* buff, const array<int>& counts, const array<int>& offsets)
+{
+    backend_->allgather(buff, counts, offsets);
+}
+
+void cluster_transport::send(void* buff, u32 size, u32 node, u32 type)
+{
+    backend_->send(buff, size, node, type);
+}
+
+u32 cluster_transport::msg_size(u32 node, u32 type)
+{
+    return backend_->msg_size(node, type);
+}
+
+bool cluster_transport::can_recive(u32 node, u32 msg_id)
+{
+    return backend_->can_receive(node, msg_id);
 }
 
 void cluster_transport::receive(void* buff, u32 size, u32 node, u32 type)
 {
-    MPI_Recv(buff, size, MPI_BYTE, node, type, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    backend_->receive(buff, size, node, type);
 }
 
 }
@@ -0,0 +1,62 @@
+#include "transport_backend.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+namespace bh {
+
+void transport_backend::create_compute_group(bool member)
+{
+    // Every rank tells every other one whether it is a member, like MPI_Comm_split
+    u8 flag = member ? 1 : 0;
+
+    for (u32 node = 0; node < ranks(); ++node) {
+        if (node != rank()) {
+            send(&flag, sizeof(flag), node, group_type);
+        }
+    }
+
+    compute_group_.clear();
+    for (u32 node = 0; node < ranks(); ++node) {
+        u8 other = flag;
+        if (node != rank()) {
+            receive(&other, sizeof(other), node, group_type);
+        }
+        if (other) {
+            compute_group_.push_back(node);
+        }
+    }
+
+    in_compute_group_ = member;
+}
+
+void transport_backend::allgather(void* buff, const array<int>& counts, const array<int>& offsets)
+{
+    if (!in_compute_group_) {
+        throw std::runtime_error("transport_backend::allgather() called outside of the compute group");
+    }
+
+    std::byte* bytes = static_cast<std::byte*>(buff);
+    u32 self         = std::find(compute_group_.begin(), compute_group_.end(), rank()) - compute_group_.begin();
+
+    // Blocking sends keep draining incoming messages, so sending to everyone first does not deadlock
+    for (u32 node : compute_group_) {
+        if (node != rank()) {
+            send(bytes + offsets[self], counts[self], node, allgather_type);
+        }
+    }
+
+    for (u32 i = 0; i < compute_group_.size(); ++i) {
+        if (i != self) {
+            receive(bytes + offsets[i], counts[i], compute_group_[i], allgather_type);
+        }
+    }
+}
+
+std::unique_ptr<host_group> transport_backend::create_host_group()
+{
+    return nullptr;
+}
+
+}
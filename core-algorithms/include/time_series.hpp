@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "types.hpp"
+
+namespace bh {
+
+// Fixed memory history of a scalar. Samples are accumulated into at most
+// Capacity buckets; when those run out neighbouring buckets are merged pairwise
+// and every bucket spans twice as many samples. Buckets keep min, max and mean,
+// so extrema survive decimation and the overall range is exact.
+template <u32 Capacity>
+class time_series {
+public:
+    static_assert(Capacity >= 2 && Capacity % 2 == 0, "Capacity should be even");
+
+    struct bucket {
+        real min;
+        real max;
+        real sum;
+        u64 count;
+
+        real mean() const
+        {
+            return sum / count;
+        }
+    };
+
+    void push(real value)
+    {
+        min_  = std::min(min_, value);
+        max_  = std::max(max_, value);
+        last_ = value;
+        ++samples_;
+
+        if (size_ != 0 && buckets_[size_ - 1].count < stride_) {
+            bucket& last = buckets_[size_ - 1];
+            last.min     = std::min(last.min, value);
+            last.max     = std::max(last.max, value);
+            last.sum += value;
+            ++last.count;
+            return;
+        }
+
+        if (size_ == Capacity) {
+            decimate();
+        }
+
+        buckets_[size_++] = bucket { .min = value, .max = value, .sum = value, .count = 1 };
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    // Number of buckets, never above Capacity
+    u32 size() const
+    {
+        return size_;
+    }
+
+    const bucket& operator[](u32 i) const
+    {
+        assert(i < size_);
+        return buckets_[i];
+    }
+
+    // Samples per bucket, the last one may hold fewer
+    u64 stride() const
+    {
+        return stride_;
+    }
+
+    u64 samples() const
+    {
+        return samples_;
+    }
+
+    real min() const
+    {
+        return min_;
+    }
+
+    real max() const
+    {
+        return max_;
+    }
+
+    real last() const
+    {
+        return last_;
+    }
+
+private:
+    void decimate()
+    {
+        for (u32 i = 0; i < Capacity / 2; ++i) {
+            const bucket& a = buckets_[2 * i];
+            const bucket& b = buckets_[2 * i + 1];
+
+            buckets_[i] = bucket { .min   = std::min(a.min, b.min),
+                                   .max   = std::max(a.max, b.max),
+                                   .sum   = a.sum + b.sum,
+                                   .count = a.count + b.count };
+        }
+
+        size_ = Capacity / 2;
+        stride_ *= 2;
+    }
+
+    static_array<bucket, Capacity> buckets_ {};
+    u32 size_ { 0 };
+    u64 stride_ { 1 };
+    u64 samples_ { 0 };
+    real min_ { std::numeric_limits<real>::infinity() };
+    real max_ { -std::numeric_limits<real>::infinity() };
+    real last_ { 0.0_r };
+};
+
+}
@@ -2,30 +2,33 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <functional>
 #include <iterator>
+#include <span>
 #include <vector>
 
 #include "linalg.hpp"
+#include "memory_tracking.hpp"
 #include "types.hpp"
 
 namespace bh {
 
-template <typename PositionalData, typename NodeData>
+template <typename PositionalData, typename NodeData, typename PointContainer = array<PositionalData>>
 class quadtree {
 public:
+    // Tree storage is accounted to memory_tag::tree
     template <typename T>
-    using internal_container = array<T>;
-    template <typename T>
-    using internal_interator = internal_container<T>::iterator;
+    using internal_container = tracked_array<T, memory_tag::tree>;
 
     static constexpr u32 max_tree_depth = 100;
     static constexpr u32 tree_dimention = 2;
 
     using point = vec<tree_dimention>;
 
-    using point_container = internal_container<PositionalData>;
-    using point_iterator  = internal_interator<PositionalData>;
+    using point_container = PointContainer;
+    using point_iterator  = point_container::iterator;
 
     struct axis_aligned_bounding_box {
         static constexpr real inf = std::numeric_limits<point::data_t>::infinity();
@@ -40,6 +43,19 @@ public:
             return *this;
         }
 
+        axis_aligned_bounding_box& operator|=(axis_aligned_bounding_box const& other)
+        {
+            min = point::min(min, other.min);
+            max = point::max(max, other.max);
+            return *this;
+        }
+
+        real area() const
+        {
+            point extent = max - min;
+            return extent[0] * extent[1];
+        }
+
         static axis_aligned_bounding_box create(point_iterator begin, point_iterator end)
         {
             axis_aligned_bounding_box result;
@@ -64,12 +80,124 @@ public:
         tree.build_tree();
     }
 
+    // Builds the subtree of points [begin, end) as region i of the next tree. Its points
+    // are only permuted among themselves, so the region keeps its range. Regions are
+    // built in any order, each as soon as its points are final, and then joined.
+    void build_region(u32 i, u32 begin, u32 end)
+    {
+        if (i >= regions_.size()) {
+            regions_.resize(i + 1);
+        }
+
+        region_tree& region = regions_[i];
+        region.nodes.clear();
+        region.points_begin.clear();
+        region.depth = 0;
+        region.built = true;
+
+        point_iterator first = points_.begin() + begin;
+        point_iterator last  = points_.begin() + end;
+        build_impl(region, axis_aligned_bounding_box::create(first, last), first, last, max_tree_depth);
+    }
+
+    // Makes the built regions the tree, under top nodes of up to four regions each. In
+    // the order of their ranges, which have to cover all points.
+    void join_regions()
+    {
+        destroy_tree();
+
+        array<u32> built;
+        u32 total = 0;
+        for (u32 i = 0; i < regions_.size(); ++i) {
+            if (regions_[i].built && !regions_[i].nodes.empty()) {
+                built.push_back(i);
+                total += regions_[i].nodes.size();
+            }
+            regions_[i].built = false;
+        }
+
+        if (built.size() == 1) {
+            // Swapped, both keep their capacity for the next build
+            std::swap(nodes_, regions_[built.front()].nodes);
+            std::swap(node_points_begin_, regions_[built.front()].points_begin);
+            depth_ = regions_[built.front()].depth;
+        } else if (built.size() > 1) {
+            join_impl(built, total);
+        }
+
+        node_points_begin_.push_back(points_.size());
+
+        nodes_view_        = nodes_;
+        points_begin_view_ = node_points_begin_;
+    }
+
+    // Summed area of the regions over the area of the tree. Grows once bodies move
+    // away from the region a build left them in, and the regions overlap.
+    real region_overlap() const
+    {
+        return region_overlap_;
+    }
+
+    // A tree over points built elsewhere, traversed in place from published memory
+    static quadtree attach(point_container& points, std::span<const std::byte> memory)
+    {
+        quadtree tree(points);
+
+        tree.attach(memory);
+
+        return tree;
+    }
+
     quadtree(const quadtree&) = delete;
     quadtree(quadtree&&)      = default;
 
+    // Bytes publish() needs for a tree of this many nodes
+    static size_t shared_bytes(u32 nodes)
+    {
+        return shared_header_bytes + nodes * sizeof(node_t) + (nodes + 1) * sizeof(u32);
+    }
+
+    // Bytes the tree last published into the memory needs, it may not have fit
+    static size_t published_bytes(std::span<const std::byte> memory)
+    {
+        shared_header header;
+        std::memcpy(&header, memory.data(), sizeof(header));
+        return shared_bytes(header.node_count);
+    }
+
+    // Copies the built tree into memory other quadtrees over the same points attach to.
+    // Only the header is written when it does not fit.
+    bool publish(std::span<std::byte> memory) const
+    {
+        shared_header header { .node_count = node_count(), .depth = depth_ };
+        std::memcpy(memory.data(), &header, sizeof(header));
+
+        if (memory.size() < shared_bytes(header.node_count)) {
+            return false;
+        }
+
+        std::byte* nodes = memory.data() + shared_header_bytes;
+        std::memcpy(nodes, nodes_view_.data(), nodes_view_.size_bytes());
+        std::memcpy(nodes + nodes_view_.size_bytes(), points_begin_view_.data(), points_begin_view_.size_bytes());
+        return true;
+    }
+
+    // Traverses the published tree in place until the next rebuild or attach
+    void attach(std::span<const std::byte> memory)
+    {
+        shared_header header;
+        std::memcpy(&header, memory.data(), sizeof(header));
+
+        const std::byte* nodes = memory.data() + shared_header_bytes;
+        nodes_view_        = { reinterpret_cast<const node_t*>(nodes), header.node_count };
+        points_begin_view_ = { reinterpret_cast<const u32*>(nodes + header.node_count * sizeof(node_t)),
+                               header.node_count + 1 };
+        depth_             = header.depth;
+    }
+
     u32 node_count() const
     {
-        return nodes_.size();
+        return nodes_view_.size();
     }
 
     u32 depth() const
@@ -79,7 +207,7 @@ public:
 
     const NodeData& get_node(u32 i) const
     {
-        return nodes_[i].data;
+        return nodes_view_[i].data;
     }
 
     const PositionalData& get_point(u32 i) const
@@ -120,6 +248,45 @@ public:
         }
     }
 
+    // Nodes per depth and leaves per point count, the last bucket of each collects the overflow
+    void shape(std::span<u32> depth_histogram, std::span<u32> leaf_occupancy) const
+    {
+        std::fill(depth_histogram.begin(), depth_histogram.end(), 0);
+        std::fill(leaf_occupancy.begin(), leaf_occupancy.end(), 0);
+
+        if (nodes_view_.empty()) {
+            return;
+        }
+
+        array<std::pair<node_id_t, u32>> stack { { root_node_id, 0 } };
+
+        while (!stack.empty()) {
+            auto [current, depth] = stack.back();
+            stack.pop_back();
+
+            ++depth_histogram[std::min<size_t>(depth, depth_histogram.size() - 1)];
+
+            if (nodes_view_[current].is_leaf()) {
+                u32 occupancy = points_begin_view_[current + 1] - points_begin_view_[current];
+                ++leaf_occupancy[std::min<size_t>(occupancy, leaf_occupancy.size() - 1)];
+                continue;
+            }
+
+            for (u32 i = 0; i < node_child_count; ++i) {
+                if (nodes_view_[current].children[i] != null_child_node_id) {
+                    stack.emplace_back(nodes_view_[current].children[i], depth + 1);
+                }
+            }
+        }
+    }
+
+    void for_each_node(std::function<void(NodeData&)> action)
+    {
+        for (node_t& node : nodes_) {
+            action(node.data);
+        }
+    }
+
     void reduce(
         std::function<void(const NodeData&)> reduce_node,
         std::function<void(const PositionalData&)> reduce_point,
@@ -137,19 +304,19 @@ private:
         std::function<void(const PositionalData&)>& reduce_point,
         std::function<bool(const axis_aligned_bounding_box aabb)>& stop_condition) const
     {
-        if (stop_condition(nodes_[current].box)) {
-            reduce_node(nodes_[current].data);
+        if (stop_condition(nodes_view_[current].box)) {
+            reduce_node(nodes_view_[current].data);
         } else {
-            if (nodes_[current].is_leaf()) {
-                for (u32 point = node_points_begin_[current]; point < node_points_begin_[current + 1]; ++point) {
+            if (nodes_view_[current].is_leaf()) {
+                for (u32 point = points_begin_view_[current]; point < points_begin_view_[current + 1]; ++point) {
                     reduce_point(points_[point]);
                 }
             } else {
                 for (u32 i = 0; i < node_child_count; ++i) {
-                    if (nodes_[current].children[i] == null_child_node_id) {
+                    if (nodes_view_[current].children[i] == null_child_node_id) {
                         continue;
                     }
-                    reduce_impl(nodes_[current].children[i], reduce_node, reduce_point, stop_condition);
+                    reduce_impl(nodes_view_[current].children[i], reduce_node, reduce_point, stop_condition);
                 }
             }
         }
@@ -162,15 +329,19 @@ private:
 
     void destroy_tree()
     {
+        depth_          = 0;
+        region_overlap_ = 1.0_r;
         nodes_.clear();
         node_points_begin_.clear();
+        nodes_view_        = {};
+        points_begin_view_ = {};
     }
 
+    // The whole tree is one region
     void build_tree()
     {
-        axis_aligned_bounding_box whole_aabb = axis_aligned_bounding_box::create(points_.begin(), points_.end());
-        build_impl(whole_aabb, points_.begin(), points_.end(), max_tree_depth);
-        node_points_begin_.push_back(points_.size());
+        build_region(0, 0, points_.size());
+        join_regions();
     }
 
     static constexpr node_id_t root_node_id = node_id_t(0);
@@ -195,20 +366,122 @@ private:
 
     using node_container = internal_container<node_t>;
 
-    node_id_t
-    build_impl(axis_aligned_bounding_box const& bbox, point_iterator begin, point_iterator end, u32 depth_limit)
+    struct shared_header {
+        u32 node_count;
+        u32 depth;
+    };
+
+    static constexpr size_t shared_header_bytes
+        = (sizeof(shared_header) + alignof(node_t) - 1) / alignof(node_t) * alignof(node_t);
+
+    // Subtree of one region, with node ids of its own
+    struct region_tree {
+        node_container nodes;
+        internal_container<u32> points_begin;
+        u32 depth { 0 };
+        bool built { false };
+    };
+
+    // Top nodes come first, so parents precede children, then the regions in order, so
+    // a leaf's points still end where the next node's begin
+    void join_impl(const array<u32>& built, u32 total)
+    {
+        node_id_t top = top_node_count(built.size());
+        nodes_.resize(top + total);
+        node_points_begin_.resize(top + total);
+
+        array<node_id_t> roots;
+        node_id_t offset = top;
+        u32 region_depth = 0;
+        real region_area = 0.0_r;
+
+        for (u32 i : built) {
+            region_tree& region = regions_[i];
+            roots.push_back(offset);
+
+            for (node_id_t id = 0; id < region.nodes.size(); ++id) {
+                node_t& node = nodes_[offset + id];
+                node         = region.nodes[id];
+                for (node_id_t& child : node.children) {
+                    if (child != null_child_node_id) {
+                        child += offset;
+                    }
+                }
+            }
+            std::copy(region.points_begin.begin(), region.points_begin.end(), node_points_begin_.begin() + offset);
+
+            offset += region.nodes.size();
+            region_depth = std::max(region_depth, region.depth);
+            region_area += region.nodes[root_node_id].box.area();
+        }
+
+        node_id_t next = root_node_id;
+        u32 top_depth  = join_top(roots, 0, roots.size(), next);
+        depth_         = top_depth + region_depth;
+
+        real area       = nodes_[root_node_id].box.area();
+        region_overlap_ = area > 0.0_r ? region_area / area : 1.0_r;
+    }
+
+    static node_id_t top_node_count(u32 regions)
+    {
+        if (regions <= 1) {
+            return 0;
+        }
+
+        u32 parts       = std::min(regions, node_child_count);
+        node_id_t count = 1;
+        for (u32 part = 0; part < parts; ++part) {
+            count += top_node_count(regions * (part + 1) / parts - regions * part / parts);
+        }
+        return count;
+    }
+
+    // Top node over roots [first, last), returns the depth it adds
+    u32 join_top(const array<node_id_t>& roots, u32 first, u32 last, node_id_t& next)
+    {
+        node_id_t current_id = next++;
+
+        u32 count = last - first;
+        u32 parts = std::min(count, node_child_count);
+        u32 depth = 0;
+
+        for (u32 part = 0; part < parts; ++part) {
+            u32 begin = first + count * part / parts;
+            u32 end   = first + count * (part + 1) / parts;
+
+            node_id_t child = roots[begin];
+            if (end - begin > 1) {
+                child = next;
+                depth = std::max(depth, join_top(roots, begin, end, next));
+            }
+
+            nodes_[current_id].children[part] = child;
+            nodes_[current_id].box |= nodes_[child].box;
+        }
+
+        node_points_begin_[current_id] = node_points_begin_[roots[first]];
+        return depth + 1;
+    }
+
+    node_id_t build_impl(
+        region_tree& tree,
+        axis_aligned_bounding_box const& bbox,
+        point_iterator begin,
+        point_iterator end,
+        u32 depth_limit)
     {
         if (begin == end) {
             return null_child_node_id;
         }
 
-        node_id_t current_id = nodes_.size();
-        nodes_.emplace_back();
+        node_id_t current_id = tree.nodes.size();
+        tree.nodes.emplace_back();
 
-        nodes_[current_id].box = bbox;
+        tree.nodes[current_id].box = bbox;
 
-        node_points_begin_.emplace_back();
-        node_points_begin_[current_id] = std::distance(points_.begin(), begin);
+        tree.points_begin.emplace_back();
+        tree.points_begin[current_id] = std::distance(points_.begin(), begin);
 
         if (depth_limit == 0) {
             return current_id;
@@ -234,27 +507,33 @@ private:
         point_iterator split_x_lower = std::partition(begin, split_y, left);
         point_iterator split_x_upper = std::partition(split_y, end, left);
 
-        axis_aligned_bounding_box box_0_0 = { bbox.min, center };
-        nodes_[current_id].children[0]    = build_impl(box_0_0, begin, split_x_lower, depth_limit - 1);
+        axis_aligned_bounding_box box_0_0  = { bbox.min, center };
+        tree.nodes[current_id].children[0] = build_impl(tree, box_0_0, begin, split_x_lower, depth_limit - 1);
 
-        axis_aligned_bounding_box box_0_1 = { point { center[0], bbox.min[1] }, point { bbox.max[0], center[1] } };
-        nodes_[current_id].children[1]    = build_impl(box_0_1, split_x_lower, split_y, depth_limit - 1);
+        axis_aligned_bounding_box box_0_1  = { point { center[0], bbox.min[1] }, point { bbox.max[0], center[1] } };
+        tree.nodes[current_id].children[1] = build_impl(tree, box_0_1, split_x_lower, split_y, depth_limit - 1);
 
-        axis_aligned_bounding_box box_1_0 = { point { bbox.min[0], center[1] }, point { center[0], bbox.max[1] } };
-        nodes_[current_id].children[2]    = build_impl(box_1_0, split_y, split_x_upper, depth_limit - 1);
+        axis_aligned_bounding_box box_1_0  = { point { bbox.min[0], center[1] }, point { center[0], bbox.max[1] } };
+        tree.nodes[current_id].children[2] = build_impl(tree, box_1_0, split_y, split_x_upper, depth_limit - 1);
 
-        axis_aligned_bounding_box box_1_1 = { center, bbox.max };
-        nodes_[current_id].children[3]    = build_impl(box_1_1, split_x_upper, end, depth_limit - 1);
+        axis_aligned_bounding_box box_1_1  = { center, bbox.max };
+        tree.nodes[current_id].children[3] = build_impl(tree, box_1_1, split_x_upper, end, depth_limit - 1);
 
-        depth_ = std::max(max_tree_depth - depth_limit, depth_);
+        tree.depth = std::max(max_tree_depth - depth_limit, tree.depth);
 
         return current_id;
     }
 
     u32 depth_ { 0 };
+    real region_overlap_ { 1.0_r };
     point_container& points_;
     node_container nodes_;
     internal_container<u32> node_points_begin_;
+    // Indexed by region, kept between builds for their capacity
+    array<region_tree> regions_;
+    // What traversal reads, the containers above or published memory
+    std::span<const node_t> nodes_view_;
+    std::span<const u32> points_begin_view_;
 };
 
 }
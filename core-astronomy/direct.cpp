@@ -0,0 +1,103 @@
+#include "direct.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <latch>
+
+#include "chunks.hpp"
+
+namespace bh {
+
+direct_summation::direct_summation(real epsilon, u32 threads)
+    : epsilon_(epsilon)
+    , threads_(std::max(threads, 1u))
+    , pool_(threads_ > 1 ? std::make_unique<thread_pool>(threads_ - 1) : nullptr)
+{
+}
+
+void direct_summation::accelerations(std::span<const point_t> points, u32 begin, u32 end, array<vec2>& result)
+{
+    x_.resize(points.size());
+    y_.resize(points.size());
+    mass_.resize(points.size());
+
+    for (u32 i = 0; i < points.size(); ++i) {
+        x_[i]    = points[i].position[0];
+        y_[i]    = points[i].position[1];
+        mass_[i] = points[i].mass;
+    }
+
+    result.resize(end - begin);
+
+    if (threads_ == 1 || end - begin < tile_size) {
+        accelerations_impl(begin, end, begin, result);
+        return;
+    }
+
+    // The calling thread takes the first chunk, the pool the others
+    array<chunk> chunks = make_chunks(end - begin, threads_);
+    std::latch done(chunks.size() - 1);
+
+    for (u32 i = 1; i < chunks.size(); ++i) {
+        pool_->post([this, c = chunks[i], begin, &result, &done](unit) -> unit {
+            accelerations_impl(begin + c.begin, begin + c.end, begin, result);
+            done.count_down();
+            return unit();
+        });
+    }
+
+    accelerations_impl(begin + chunks[0].begin, begin + chunks[0].end, begin, result);
+    done.wait();
+}
+
+void direct_summation::accelerations_impl(u32 begin, u32 end, u32 offset, array<vec2>& result) const
+{
+    const u32 count = x_.size();
+
+    const real* __restrict x    = x_.data();
+    const real* __restrict y    = y_.data();
+    const real* __restrict mass = mass_.data();
+
+    real ax[tile_size];
+    real ay[tile_size];
+
+    for (u32 target_tile = begin; target_tile < end; target_tile += tile_size) {
+        const u32 targets = std::min(tile_size, end - target_tile);
+
+        std::fill_n(ax, targets, 0.0_r);
+        std::fill_n(ay, targets, 0.0_r);
+
+        for (u32 source_tile = 0; source_tile < count; source_tile += tile_size) {
+            const u32 sources_end = std::min(source_tile + tile_size, count);
+
+            for (u32 t = 0; t < targets; ++t) {
+                const real tx = x[target_tile + t];
+                const real ty = y[target_tile + t];
+
+                real sum_x = 0.0_r;
+                real sum_y = 0.0_r;
+
+                for (u32 s = source_tile; s < sources_end; ++s) {
+                    const real dx  = tx - x[s];
+                    const real dy  = ty - y[s];
+                    const real r2  = dx * dx + dy * dy;
+                    const real len = std::sqrt(r2) + epsilon_;
+                    // Coincident bodies (including the target itself) do not interact
+                    const real factor = r2 > 0.0_r ? mass[s] / (len * len * len) : 0.0_r;
+
+                    sum_x -= dx * factor;
+                    sum_y -= dy * factor;
+                }
+
+                ax[t] += sum_x;
+                ay[t] += sum_y;
+            }
+        }
+
+        for (u32 t = 0; t < targets; ++t) {
+            result[target_tile + t - offset] = vec2 { ax[t], ay[t] };
+        }
+    }
+}
+
+}
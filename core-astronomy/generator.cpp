@@ -10,12 +10,12 @@ generator::generator(generator_params params)
 {
 }
 
-array<point_t> generator::generate()
+particle_array generator::generate()
 {
-    array<point_t> points;
+    particle_array points;
 
     std::random_device rand_dev;
-    std::mt19937 rand_engine(rand_dev());
+    std::mt19937 rand_engine(params_.seed ? *params_.seed : rand_dev());
     std::uniform_real_distribution<real> angle_dist(0.0_r, 2.0_r * M_PI);
     std::uniform_real_distribution<real> enclosed_mass_dist(0.0_r, 1.0_r);
     std::uniform_real_distribution<real> position_distribution(-1.0_r, 1.0_r);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+
+#include "linalg.hpp"
+#include "model.hpp"
+#include "thread_pool.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+// Exact O(N^2) summation with the same softened kernel as the tree's point-point
+// interactions. Sources are staged into structure-of-arrays buffers and visited
+// tile by tile, so the inner loop stays in L1 and vectorizes.
+class direct_summation {
+public:
+    static constexpr u32 tile_size = 512;
+
+    direct_summation(real epsilon, u32 threads = 1);
+
+    // Accelerations of bodies [begin, end) due to all bodies, result[i - begin]
+    void accelerations(std::span<const point_t> points, u32 begin, u32 end, array<vec2>& result);
+
+private:
+    void accelerations_impl(u32 begin, u32 end, u32 offset, array<vec2>& result) const;
+
+    real epsilon_;
+    u32 threads_;
+    // Helpers of the calling thread, kept for the solver's lifetime so a step does not
+    // start threads. Null with one thread.
+    std::unique_ptr<thread_pool> pool_;
+    tracked_array<real, memory_tag::solver> x_;
+    tracked_array<real, memory_tag::solver> y_;
+    tracked_array<real, memory_tag::solver> mass_;
+};
+
+}
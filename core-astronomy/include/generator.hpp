@@ -1,5 +1,7 @@
 #pragma once
 
+#include <optional>
+
 #include "model.hpp"
 
 namespace bh {
@@ -7,13 +9,15 @@ namespace bh {
 struct generator_params {
     u32 count;
     real scale_factor;
+    // The same model for the same seed, a random one without
+    std::optional<u32> seed {};
 };
 
 class generator {
 public:
     generator(generator_params params);
 
-    array<point_t> generate();
+    particle_array generate();
 
 private:
     generator_params params_;
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <span>
+
 #include "linalg.hpp"
+#include "memory_tracking.hpp"
 #include "types.hpp"
 
 namespace bh {
@@ -11,6 +14,10 @@ struct point_t {
     real mass {};
 };
 
+using particle_array = tracked_array<point_t, memory_tag::particles>;
+// Particles owned by a particle_array or by memory shared between ranks
+using particle_span = std::span<point_t>;
+
 struct node_t {
     real mass {};
     vec2 mass_center {};
@@ -1,11 +1,17 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <limits>
+#include <span>
 #include <vector>
 
+#include "direct.hpp"
 #include "linalg.hpp"
 #include "model.hpp"
+#include "perf_counters.hpp"
+#include "tracing.hpp"
 #include "tree.hpp"
 
 namespace bh {
@@ -18,61 +24,213 @@ struct solver_params {
     real epsilon;
     real accuracy_parameter;
     bool adaptive_timestep;
+    // below this many bodies direct summation is cheaper than building a tree
+    u32 direct_threshold;
+    u32 direct_threads;
+};
+
+// Per body traversal counters
+struct body_stats {
+    u32 node_interactions { 0 };
+    u32 point_interactions { 0 };
+    u32 opened_cells { 0 };
+};
+
+// Traversal counters of a chunk of bodies and the shape of the tree they walked
+struct solver_stats {
+    static constexpr u32 depth_buckets     = 32;
+    static constexpr u32 occupancy_buckets = 16;
+
+    u32 bodies { 0 };
+    u64 node_interactions { 0 };
+    u64 point_interactions { 0 };
+    u64 opened_cells { 0 };
+    u32 max_body_interactions { 0 };
+    u32 tree_nodes { 0 };
+    u32 tree_depth { 0 };
+    real build_time { 0.0_r };
+    real step_time { 0.0_r };
+    static_array<u32, depth_buckets> depth_histogram {};
+    static_array<u32, occupancy_buckets> leaf_occupancy {};
+
+    // Counters add up over chunks, every rank builds the same tree
+    void merge(const solver_stats& other)
+    {
+        bodies += other.bodies;
+        node_interactions += other.node_interactions;
+        point_interactions += other.point_interactions;
+        opened_cells += other.opened_cells;
+        max_body_interactions = std::max(max_body_interactions, other.max_body_interactions);
+        tree_nodes            = std::max(tree_nodes, other.tree_nodes);
+        tree_depth            = std::max(tree_depth, other.tree_depth);
+        build_time            = std::max(build_time, other.build_time);
+        step_time             = std::max(step_time, other.step_time);
+
+        for (u32 i = 0; i < depth_buckets; ++i) {
+            depth_histogram[i] = std::max(depth_histogram[i], other.depth_histogram[i]);
+        }
+        for (u32 i = 0; i < occupancy_buckets; ++i) {
+            leaf_occupancy[i] = std::max(leaf_occupancy[i], other.leaf_occupancy[i]);
+        }
+    }
 };
 
 class solver {
 public:
-    using quadree = quadtree<point_t, node_t>;
+    using quadree = quadtree<point_t, node_t, particle_span>;
+
+    solver(solver_params params, particle_span points, particle_span points_copy)
+        : points_(points)
+        , points_copy_(points_copy)
+        , params_(params)
+        , tree_(timed_build(points_, stats_.build_time))
+        , direct_(params.epsilon, params.direct_threads)
+        , t_(0.0_r)
+    {
+    }
 
-    solver(solver_params params, array<point_t>& points, array<point_t>& points_copy)
+    // For ranks sharing the points with another rank's solver, which builds the tree
+    // and publishes it into the memory. Never rebuilds, attach_tree() follows the builder.
+    solver(solver_params params, particle_span points, particle_span points_copy, std::span<const std::byte> tree)
         : points_(points)
         , points_copy_(points_copy)
         , params_(params)
-        , tree_(quadree::build(points_))
+        , tree_(quadree::attach(points_, tree))
+        , direct_(params.epsilon, params.direct_threads)
         , t_(0.0_r)
     {
     }
 
+    // Above this quadree::region_overlap() the regions are given up for one full build
+    static constexpr real max_region_overlap = 2.0;
+
     void rebuild_tree()
     {
-        quadree::rebuild(tree_);
+        if (use_direct_summation()) {
+            return;
+        }
 
-        // Compute node masses
+        auto build_begin = std::chrono::steady_clock::now();
 
-        tree_.walk_leafs([](node_t& node, point_t point) { node.mass += point.mass; });
+        {
+            TRACE_SCOPE("tree_build");
+            PERF_SCOPE("tree_build");
+            quadree::rebuild(tree_);
+        }
 
-        tree_.walk_nodes([](node_t& parent, node_t& child) { parent.mass += child.mass; });
+        compute_moments(build_begin);
+    }
 
-        // Compute node mass centers
+    // Builds region i of the next tree from bodies [begin, end), see quadree::build_region().
+    // Every rank has to build the same regions to permute the bodies the same way.
+    void build_tree_region(u32 i, u32 begin, u32 end)
+    {
+        if (use_direct_summation()) {
+            return;
+        }
 
-        tree_.walk_leafs(
-            [](node_t& node, point_t point) { node.mass_center = point.position * point.mass + node.mass_center; });
+        auto build_begin = std::chrono::steady_clock::now();
 
-        tree_.walk_leafs(
-            [](node_t& node, [[maybe_unused]] point_t point) { node.mass_center = node.mass_center / node.mass; });
+        {
+            TRACE_SCOPE("region_build");
+            PERF_SCOPE("tree_build");
+            tree_.build_region(i, begin, end);
+        }
+
+        region_build_time_ += std::chrono::duration<real>(std::chrono::steady_clock::now() - build_begin).count();
+    }
+
+    // Instead of rebuild_tree(), once every region is built
+    void join_tree_regions()
+    {
+        if (use_direct_summation()) {
+            return;
+        }
+
+        auto build_begin = std::chrono::steady_clock::now();
+
+        {
+            TRACE_SCOPE("tree_build");
+            PERF_SCOPE("tree_build");
+            tree_.join_regions();
+
+            // Also sorts the bodies into compact regions again
+            if (tree_.region_overlap() > max_region_overlap) {
+                quadree::rebuild(tree_);
+            }
+        }
+
+        compute_moments(build_begin);
+    }
 
-        tree_.walk_nodes([](node_t& parent, node_t& child) {
-            parent.mass_center = child.mass_center * child.mass + parent.mass_center;
-        });
+    // False if the tree does not fit, quadree::published_bytes() tells how much it needs
+    bool publish_tree(std::span<std::byte> memory) const
+    {
+        return tree_.publish(memory);
+    }
 
-        tree_.walk_nodes([](node_t& parent, [[maybe_unused]] node_t& child) {
-            parent.mass_center = parent.mass_center / parent.mass;
-        });
+    void attach_tree(std::span<const std::byte> memory)
+    {
+        tree_.attach(memory);
     }
 
     void step(u32 begin, u32 end)
     {
-        dt_ = calculate_timestap();
+        integrate(begin, end);
+        commit(begin, end);
+    }
+
+    // First half of step(): new states of bodies [begin, end) go to points_copy. Ranks
+    // sharing the points commit only once all of them are done reading.
+    void integrate(u32 begin, u32 end)
+    {
+        auto step_begin = std::chrono::steady_clock::now();
+
+        {
+            TRACE_SCOPE("timestep");
+            PERF_SCOPE("timestep");
+            dt_ = calculate_timestap();
+        }
+
+        TRACE_SCOPE("traversal");
+        PERF_SCOPE("traversal");
 
-        for (u32 i = begin; i < end; ++i) {
-            model_body(i);
+        if (statistics_enabled_) {
+            body_stats_.assign(end - begin, body_stats {});
         }
 
-        std::swap(points_, points_copy_);
+        if (use_direct_summation()) {
+            direct_.accelerations(points_, begin, end, accelerations_);
+
+            for (u32 i = begin; i < end; ++i) {
+                points_copy_[i] = integrator_step(points_[i], accelerations_[i - begin], dt_);
+            }
+
+            if (statistics_enabled_) {
+                body_stats_.assign(
+                    end - begin, body_stats { .point_interactions = static_cast<u32>(points_.size() - 1) });
+            }
+        } else {
+            for (u32 i = begin; i < end; ++i) {
+                model_body(i, statistics_enabled_ ? &body_stats_[i - begin] : nullptr);
+            }
+        }
+
+        if (statistics_enabled_) {
+            collect_statistics();
+            stats_.step_time = std::chrono::duration<real>(std::chrono::steady_clock::now() - step_begin).count();
+        }
 
         t_ += dt_;
     }
 
+    void commit(u32 begin, u32 end)
+    {
+        // Copied back rather than swapped, so bodies outside the chunk keep their state
+        // and points_ stays the only full copy
+        std::copy(points_copy_.begin() + begin, points_copy_.begin() + end, points_.begin() + begin);
+    }
+
     bool finished()
     {
         return t_ > params_.t;
@@ -83,23 +241,117 @@ public:
         return t_;
     }
 
-    real total_energy()
+    // Timestep of the last step
+    real timestep() const
+    {
+        return dt_;
+    }
+
+    // Opt-in, counting costs a branch per interaction. The tree built so far is measured
+    // right away, so the first step reports its shape too.
+    void enable_statistics()
+    {
+        statistics_enabled_ = true;
+
+        if (!use_direct_summation()) {
+            record_tree_shape();
+        }
+    }
+
+    // Counters of the last step and shape of the last built tree
+    const solver_stats& statistics() const
+    {
+        return stats_;
+    }
+
+    const tracked_array<body_stats, memory_tag::solver>& body_statistics() const
+    {
+        return body_stats_;
+    }
+
+    bool use_direct_summation() const
+    {
+        return points_.size() < params_.direct_threshold;
+    }
+
+    // Barnes-Hut acceleration of body i, requires an up to date tree
+    vec2 tree_acceleration(u32 i, body_stats* stats = nullptr)
+    {
+        vec2 acceleration { 0.0_r, 0.0_r };
+
+        point_t current = tree_.get_point(i);
+
+        tree_.reduce(
+            [&acceleration, &current, stats](const node_t& node) {
+                acceleration = acceleration + compute_acceleration(current, node);
+                if (stats) {
+                    ++stats->node_interactions;
+                }
+            },
+            [this, &acceleration, &current, stats](const point_t& point) {
+                if (point.position == current.position) {
+                    return;
+                }
+
+                acceleration = acceleration + compute_acceleration(current, point, params_.epsilon);
+                if (stats) {
+                    ++stats->point_interactions;
+                }
+            },
+            [this, i, stats](quadree::axis_aligned_bounding_box aabb) -> bool {
+                bool far = (aabb.max - aabb.min).len() / (points_[i].position - (aabb.max + aabb.min) / 2.0).len()
+                    < params_.theta;
+                if (stats && !far) {
+                    ++stats->opened_cells;
+                }
+                return far;
+            });
+
+        return acceleration;
+    }
+
+    // Exact accelerations of bodies [begin, end), reference for the tree
+    array<vec2> exact_accelerations(u32 begin, u32 end)
+    {
+        array<vec2> result;
+        direct_.accelerations(points_, begin, end, result);
+        return result;
+    }
+
+    vec2 total_momentum() const
+    {
+        vec2 momentum { 0.0_r, 0.0_r };
+
+        for (const point_t& point : points_) {
+            momentum = momentum + point.velocity * point.mass;
+        }
+
+        return momentum;
+    }
+
+    real total_energy() const
+    {
+        return total_energy(points_);
+    }
+
+    // Quadratic in the bodies, for a copy of them outside the solver as well
+    static real total_energy(std::span<const point_t> points)
     {
         real kinetic   = 0.0_r;
         real potential = 0.0_r;
 
-        for (size_t i = 0; i < points_.size(); ++i) {
-            kinetic += 0.5 * points_[i].mass * vec2::dot(points_[i].velocity, points_[i].velocity);
+        for (size_t i = 0; i < points.size(); ++i) {
+            kinetic += 0.5 * points[i].mass * vec2::dot(points[i].velocity, points[i].velocity);
         }
 
-        for (u32 i = 0; i < points_.size(); ++i) {
-            for (u32 j = 0; j < points_.size(); ++j) {
+        for (u32 i = 0; i < points.size(); ++i) {
+            for (u32 j = 0; j < points.size(); ++j) {
                 if (i == j) {
                     continue;
                 }
 
                 potential
-                    += -0.5 * points_[i].mass * points_[j].mass / (points_[i].position - points_[j].position).len();
+                    += -0.5 * points[i].mass * points[j].mass / (points[i].position - points[j].position).len();
             }
         }
 
@@ -107,6 +359,54 @@ public:
     }
 
 private:
+    // Masses and mass centers of a tree whose build started at build_begin
+    void compute_moments(std::chrono::steady_clock::time_point build_begin)
+    {
+        TRACE_SCOPE("moments");
+        PERF_SCOPE("moments");
+
+        // Compute node masses
+
+        tree_.walk_leafs([](node_t& node, point_t point) { node.mass += point.mass; });
+
+        tree_.walk_nodes([](node_t& parent, node_t& child) { parent.mass += child.mass; });
+
+        // Compute node mass centers: mass weighted sums first, normalized once per node
+
+        tree_.walk_leafs(
+            [](node_t& node, point_t point) { node.mass_center = point.position * point.mass + node.mass_center; });
+
+        tree_.walk_nodes(
+            [](node_t& parent, node_t& child) { parent.mass_center = child.mass_center + parent.mass_center; });
+
+        tree_.for_each_node([](node_t& node) { node.mass_center = node.mass_center / node.mass; });
+
+        if (statistics_enabled_) {
+            stats_.build_time = region_build_time_
+                + std::chrono::duration<real>(std::chrono::steady_clock::now() - build_begin).count();
+            record_tree_shape();
+        }
+        region_build_time_ = 0.0_r;
+    }
+
+    void record_tree_shape()
+    {
+        stats_.tree_nodes = tree_.node_count();
+        stats_.tree_depth = tree_.depth();
+        tree_.shape(stats_.depth_histogram, stats_.leaf_occupancy);
+    }
+
+    // The first tree is built before statistics can be enabled, so its time is always kept
+    static quadree timed_build(particle_span& points, real& build_time)
+    {
+        auto build_begin = std::chrono::steady_clock::now();
+
+        quadree tree = quadree::build(points);
+
+        build_time = std::chrono::duration<real>(std::chrono::steady_clock::now() - build_begin).count();
+        return tree;
+    }
+
     real calculate_timestap()
     {
         real result = params_.dt;
@@ -131,37 +431,42 @@ private:
         return result * params_.accuracy_parameter;
     }
 
-    void model_body(u32 i)
+    void model_body(u32 i, body_stats* stats)
     {
-        vec2 acceleration { 0.0_r, 0.0_r };
-
-        point_t current = tree_.get_point(i);
-
-        tree_.reduce(
-            [&acceleration, &current](const node_t& node) {
-                acceleration = acceleration + compute_acceleration(current, node);
-            },
-            [this, &acceleration, &current](const point_t& point) {
-                if (point.position == current.position) {
-                    return;
-                }
-
-                acceleration = acceleration + compute_acceleration(current, point, params_.epsilon);
-            },
-            [this, i](quadree::axis_aligned_bounding_box aabb) -> bool {
-                return (aabb.max - aabb.min).len() / (points_[i].position - (aabb.max + aabb.min) / 2.0).len()
-                    < params_.theta;
-            });
+        points_copy_[i] = integrator_step(tree_.get_point(i), tree_acceleration(i, stats), dt_);
+    }
 
-        points_copy_[i] = integrator_step(current, acceleration, dt_);
+    void collect_statistics()
+    {
+        stats_.bodies                = body_stats_.size();
+        stats_.node_interactions     = 0;
+        stats_.point_interactions    = 0;
+        stats_.opened_cells          = 0;
+        stats_.max_body_interactions = 0;
+
+        for (const body_stats& body : body_stats_) {
+            stats_.node_interactions += body.node_interactions;
+            stats_.point_interactions += body.point_interactions;
+            stats_.opened_cells += body.opened_cells;
+            stats_.max_body_interactions
+                = std::max(stats_.max_body_interactions, body.node_interactions + body.point_interactions);
+        }
     }
 
-    array<point_t>& points_;
-    array<point_t>& points_copy_;
+    particle_span points_;
+    particle_span points_copy_;
     solver_params params_;
+    // Ahead of tree_, whose build time it takes
+    solver_stats stats_;
     quadree tree_;
+    direct_summation direct_;
+    array<vec2> accelerations_;
+    bool statistics_enabled_ { false };
+    tracked_array<body_stats, memory_tag::solver> body_stats_;
     real t_;
-    real dt_;
+    real dt_ { 0.0_r };
+    // Regions built since the last join
+    real region_build_time_ { 0.0_r };
 };
 
 }
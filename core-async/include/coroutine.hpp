@@ -0,0 +1,118 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "ev_loop.hpp"
+#include "future.hpp"
+#include "task.hpp"
+
+// Coroutines returning future<T>. They start eagerly, run until the first
+// co_await that has to wait and resolve the future on co_return. The frame is
+// the only allocation, it is freed once the coroutine finishes.
+//
+// co_await on a future resumes on the thread that resolved it, which is the
+// loop thread for transport operations and ev_loop::offload().
+
+namespace bh {
+
+template <typename T>
+class future_coroutine {
+public:
+    future<T> get_return_object()
+    {
+        return std::move(pair_.first);
+    }
+
+    std::suspend_never initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    std::suspend_never final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void return_value(T value)
+    {
+        pair_.second.resolve(std::move(value));
+    }
+
+    // Exceptions are fatal in core-async, nothing would resolve the future or free the frame
+    void unhandled_exception()
+    {
+        std::terminate();
+    }
+
+private:
+    std::pair<future<T>, promice<T>> pair_ { create_futue_promice_pair<T>() };
+};
+
+template <typename T>
+class future_awaiter {
+public:
+    explicit future_awaiter(future<T> fut)
+        : fut_(std::move(fut))
+    {
+    }
+
+    bool await_ready()
+    {
+        return fut_.resolved();
+    }
+
+    // Resolved since await_ready(): the coroutine carries on without suspending instead of
+    // being resumed from in here
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        return fut_.attach([handle](T) -> unit {
+            handle.resume();
+            return unit();
+        });
+    }
+
+    T await_resume()
+    {
+        return fut_.get();
+    }
+
+private:
+    future<T> fut_;
+};
+
+template <typename T>
+future_awaiter<T> operator co_await(future<T>&& fut)
+{
+    return future_awaiter<T>(std::move(fut));
+}
+
+// co_await reschedule() lets the loop run queued tasks and poll its sources
+// before the coroutine continues
+class reschedule {
+public:
+    bool await_ready() const
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        postToEvLoop([handle](unit) -> unit {
+            handle.resume();
+            return unit();
+        });
+    }
+
+    void await_resume() const
+    {
+    }
+};
+
+}
+
+template <typename T, typename... Args>
+struct std::coroutine_traits<bh::future<T>, Args...> {
+    using promise_type = bh::future_coroutine<T>;
+};
@@ -1,12 +1,89 @@
 #pragma once
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "future.hpp"
+#include "mpsc_queue.hpp"
 #include "task.hpp"
+#include "thread_pool.hpp"
+#include "types.hpp"
 
 namespace bh {
 
+// Work the loop waits on besides its queue, e.g. messages and requests in flight
+class event_source {
+public:
+    virtual ~event_source() = default;
+
+    // Completes whatever is ready, true if anything did
+    virtual bool progress() = 0;
+    // True while anything is outstanding
+    virtual bool waiting() const = 0;
+};
+
+// How a loop with nothing to run waits for its sources: polls spin_rounds times,
+// then yields yield_rounds times, then sleeps with doubling intervals up to max_sleep
+struct idle_policy {
+    u32 spin_rounds { 1000 };
+    u32 yield_rounds { 1000 };
+    std::chrono::microseconds max_sleep { 500 };
+};
+
+// Growable ring buffer of tasks, pushing and popping do not allocate once it has grown
+class task_queue {
+public:
+    bool empty() const
+    {
+        return count_ == 0;
+    }
+
+    size_t size() const
+    {
+        return count_;
+    }
+
+    void push_back(unique_task<unit, unit> task)
+    {
+        if (count_ == slots_.size()) {
+            grow();
+        }
+
+        slots_[(head_ + count_) & (slots_.size() - 1)] = std::move(task);
+        ++count_;
+    }
+
+    unique_task<unit, unit> pop_front()
+    {
+        unique_task<unit, unit> task = std::move(slots_[head_]);
+        head_                        = (head_ + 1) & (slots_.size() - 1);
+        --count_;
+        return task;
+    }
+
+private:
+    void grow()
+    {
+        // Power of two capacity, so wrapping around is a mask
+        std::vector<unique_task<unit, unit>> slots(std::max<size_t>(64, slots_.size() * 2));
+        for (size_t i = 0; i < count_; ++i) {
+            slots[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+        }
+
+        slots_.swap(slots);
+        head_ = 0;
+    }
+
+    std::vector<unique_task<unit, unit>> slots_;
+    size_t head_ { 0 };
+    size_t count_ { 0 };
+};
+
 class ev_loop {
 public:
     ev_loop() = default;
@@ -16,34 +93,141 @@ public:
         stop_ = false;
         task(unit());
 
-        while (!stop_ && !task_queue_.empty()) {
-            task_queue_.front()(unit());
-            task_queue_.pop_front();
+        u32 idle_rounds = 0;
+
+        while (!stop_) {
+            // Tasks queued by this round run in the next one, after the sources are polled
+            for (size_t queued = task_queue_.size(); queued > 0 && !stop_; --queued) {
+                task_queue_.pop_front()(unit());
+            }
+
+            if (stop_) {
+                break;
+            }
+
+            bool progressed = false;
+            while (std::optional<unique_task<unit, unit>> task = injected_.pop()) {
+                task_queue_.push_back(std::move(*task));
+                progressed = true;
+            }
+
+            for (event_source* source : sources_) {
+                progressed |= source->progress();
+            }
+
+            if (progressed || !task_queue_.empty()) {
+                idle_rounds = 0;
+                continue;
+            }
+
+            auto waiting = [](event_source* source) { return source->waiting(); };
+            if (offloaded_.load(std::memory_order_acquire) == 0
+                && std::none_of(sources_.begin(), sources_.end(), waiting)) {
+                break;
+            }
+
+            idle(idle_rounds++);
         }
     }
 
-    template <typename Ret>
-    future<Ret> push(task_t<Ret, unit> task)
+    template <typename Ret, typename Task>
+    future<Ret> push(Task&& task)
     {
         auto [fut, prom] = create_futue_promice_pair<Ret>();
-        task_queue_.push_back([task = std::move(task), prom = std::move(prom)](unit) mutable -> unit {
+        task_queue_.push_back([task = std::forward<Task>(task), prom = std::move(prom)](unit) mutable -> unit {
             prom.resolve(task(unit()));
             return unit();
         });
         return std::move(fut);
     }
 
+    // Fire and forget, no future to resolve
+    template <typename Task>
+    void post(Task&& task)
+    {
+        task_queue_.push_back(std::forward<Task>(task));
+    }
+
+    // post() for other threads, the task runs on the loop thread
+    template <typename Task>
+    void inject(Task&& task)
+    {
+        injected_.push(unique_task<unit, unit>(std::forward<Task>(task)));
+    }
+
+    // Runs the task on the pool and resolves the future back on the loop thread.
+    // The loop keeps running until the result is in.
+    template <typename Ret, typename Task>
+    future<Ret> offload(thread_pool& pool, Task&& task)
+    {
+        auto [fut, prom] = create_futue_promice_pair<Ret>();
+        offloaded_.fetch_add(1, std::memory_order_relaxed);
+
+        pool.post([this, task = std::forward<Task>(task), prom = std::move(prom)](unit) mutable -> unit {
+            inject([this, prom = std::move(prom), result = task(unit())](unit) mutable -> unit {
+                offloaded_.fetch_sub(1, std::memory_order_release);
+                prom.resolve(std::move(result));
+                return unit();
+            });
+            return unit();
+        });
+
+        return std::move(fut);
+    }
+
     void stop()
     {
         stop_ = true;
     }
 
+    bool stopped() const
+    {
+        return stop_;
+    }
+
+    void add_source(event_source* source)
+    {
+        sources_.push_back(source);
+    }
+
+    void remove_source(event_source* source)
+    {
+        sources_.erase(std::remove(sources_.begin(), sources_.end(), source), sources_.end());
+    }
+
+    void set_idle_policy(idle_policy policy)
+    {
+        idle_policy_ = policy;
+    }
+
 private:
-    std::list<task_t<unit, unit>> task_queue_;
-    bool stop_;
+    void idle(u32 round)
+    {
+        if (round < idle_policy_.spin_rounds) {
+            return;
+        }
+
+        round -= idle_policy_.spin_rounds;
+        if (round < idle_policy_.yield_rounds) {
+            std::this_thread::yield();
+            return;
+        }
+
+        round -= idle_policy_.yield_rounds;
+        std::chrono::microseconds sleep { 1 << std::min(round, 20u) };
+        std::this_thread::sleep_for(std::min(sleep, idle_policy_.max_sleep));
+    }
+
+    task_queue task_queue_;
+    mpsc_queue<unique_task<unit, unit>> injected_;
+    std::atomic<u32> offloaded_ { 0 };
+    std::vector<event_source*> sources_;
+    idle_policy idle_policy_;
+    bool stop_ { false };
 };
 
-inline ev_loop g_event_loop;
+// One loop per thread, so ranks running as threads of one process each get their own
+inline thread_local ev_loop g_event_loop;
 
 inline void startEvLoop(task_t<unit, unit> task)
 {
@@ -55,10 +239,16 @@ inline void stopEvLoop()
     g_event_loop.stop();
 }
 
-template <typename Ret>
-inline future<Ret> pushToEvLoop(task_t<Ret, unit> task)
+template <typename Ret, typename Task>
+inline future<Ret> pushToEvLoop(Task&& task)
+{
+    return g_event_loop.push<Ret>(std::forward<Task>(task));
+}
+
+template <typename Task>
+inline void postToEvLoop(Task&& task)
 {
-    return g_event_loop.push<Ret>(std::move(task));
+    g_event_loop.post(std::forward<Task>(task));
 }
 
 }
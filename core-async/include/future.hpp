@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <memory>
 #include <utility>
+#include <vector>
 
 #include "task.hpp"
+#include "types.hpp"
 
 namespace bh {
 
@@ -16,12 +20,71 @@ class promice;
 template <typename T>
 std::pair<future<T>, promice<T>> create_futue_promice_pair() noexcept;
 
+// pending -> resolved, or pending -> continued -> resolved when then() comes first
+enum class future_state : u32 {
+    pending,
+    continued,
+    resolved,
+};
+
+// Shared by a future and its promice, which may live on different threads
 template <typename T>
 struct future_promice_control_block {
-    size_t refcount { 0 };
-    bool resolved { false };
+    std::atomic<size_t> refcount { 0 };
+    std::atomic<future_state> state { future_state::pending };
     T value {};
-    task_t<unit, T> then_action {};
+    unique_task<unit, T> then_action {};
+};
+
+// Released control blocks are kept for reuse, one free list per thread and type
+template <typename T>
+class control_block_pool {
+public:
+    ~control_block_pool()
+    {
+        destroyed_ = true;
+        for (future_promice_control_block<T>* block : free_) {
+            delete block;
+        }
+    }
+
+    static future_promice_control_block<T>* acquire()
+    {
+        control_block_pool& pool = instance();
+        if (destroyed_ || pool.free_.empty()) {
+            return new future_promice_control_block<T>();
+        }
+
+        future_promice_control_block<T>* block = pool.free_.back();
+        pool.free_.pop_back();
+        return block;
+    }
+
+    static void release(future_promice_control_block<T>* block)
+    {
+        // Blocks released during thread teardown, e.g. by tasks left in a stopped loop
+        if (destroyed_) {
+            delete block;
+            return;
+        }
+
+        block->state.store(future_state::pending, std::memory_order_relaxed);
+        block->value = T {};
+        block->then_action.reset();
+
+        instance().free_.push_back(block);
+    }
+
+private:
+    static control_block_pool& instance()
+    {
+        thread_local control_block_pool pool;
+        return pool;
+    }
+
+    static inline thread_local bool destroyed_ { false };
+
+    std::vector<future_promice_control_block<T>*> free_;
 };
 
 template <typename T>
@@ -33,33 +96,34 @@ public:
             return;
         }
 
-        --control_block_->refcount;
-        if (control_block_->refcount == 0) {
-            delete control_block_;
+        if (control_block_->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            control_block_pool<T>::release(control_block_);
         }
     }
 
     promice(const promice& other)
         : control_block_(other.control_block_)
     {
-        ++control_block_->refcount;
+        control_block_->refcount.fetch_add(1, std::memory_order_relaxed);
     }
 
     promice() = delete;
 
-    promice(promice&& other)
+    promice(promice&& other) noexcept
     {
         control_block_       = other.control_block_;
         other.control_block_ = nullptr;
     }
 
+    // The continuation, if any, runs on the resolving thread
     void resolve(T value)
     {
-        control_block_->resolved = true;
-        control_block_->value    = std::move(value);
-        if (control_block_->then_action) {
-            control_block_->then_action(control_block_->value);
-            control_block_->then_action = {};
+        control_block_->value = std::move(value);
+
+        future_state previous = control_block_->state.exchange(future_state::resolved, std::memory_order_acq_rel);
+        if (previous == future_state::continued) {
+            unique_task<unit, T> action = std::move(control_block_->then_action);
+            action(control_block_->value);
         }
     }
 
@@ -70,7 +134,7 @@ private:
     promice(future_promice_control_block<T>* control_block) noexcept
         : control_block_(control_block)
     {
-        ++control_block_->refcount;
+        control_block_->refcount.fetch_add(1, std::memory_order_relaxed);
     }
 
     future_promice_control_block<T>* control_block_;
@@ -85,16 +149,15 @@ public:
             return;
         }
 
-        --control_block_->refcount;
-        if (control_block_->refcount == 0) {
-            delete control_block_;
+        if (control_block_->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            control_block_pool<T>::release(control_block_);
         }
     }
 
     future(const future&) = delete;
     future()              = delete;
 
-    future(future&& other)
+    future(future&& other) noexcept
     {
         control_block_       = other.control_block_;
         other.control_block_ = nullptr;
@@ -105,7 +168,7 @@ public:
 
     bool resolved()
     {
-        return control_block_->resolved;
+        return control_block_->state.load(std::memory_order_acquire) == future_state::resolved;
     }
 
     T get()
@@ -113,14 +176,25 @@ public:
         return control_block_->value;
     }
 
-    template <typename Ret>
-    future<Ret> then(task_t<Ret, T> task);
+    template <typename Ret, typename Task>
+    future<Ret> then(Task&& task);
+
+    // Leaves the action to the resolving thread. False if the future is already resolved,
+    // the action then stays in the block unrun
+    bool attach(unique_task<unit, T> action)
+    {
+        control_block_->then_action = std::move(action);
+
+        future_state expected = future_state::pending;
+        return control_block_->state.compare_exchange_strong(
+            expected, future_state::continued, std::memory_order_acq_rel);
+    }
 
 private:
     future(future_promice_control_block<T>* control_block) noexcept
         : control_block_(control_block)
     {
-        ++control_block_->refcount;
+        control_block_->refcount.fetch_add(1, std::memory_order_relaxed);
     }
 
     future_promice_control_block<T>* control_block_;
@@ -129,23 +203,71 @@ private:
 template <typename T>
 std::pair<future<T>, promice<T>> create_futue_promice_pair() noexcept
 {
-    future_promice_control_block<T>* contol_block = new future_promice_control_block<T>();
+    future_promice_control_block<T>* contol_block = control_block_pool<T>::acquire();
     future<T> fut(contol_block);
     promice<T> prom(contol_block);
     return std::pair<future<T>, promice<T>>(std::move(fut), std::move(prom));
 }
 
 template <typename Arg>
-template <typename Ret>
-future<Ret> future<Arg>::then(task_t<Ret, Arg> task)
+template <typename Ret, typename Task>
+future<Ret> future<Arg>::then(Task&& task)
 {
     auto [fut, prom] = create_futue_promice_pair<Ret>();
 
-    control_block_->then_action = [prom = std::move(prom), task = std::move(task)](Arg arg) mutable -> unit {
+    unique_task<unit, Arg> action = [prom = std::move(prom), task = std::forward<Task>(task)](Arg arg) mutable -> unit {
         prom.resolve(task(std::move(arg)));
         return unit();
     };
 
+    // Already resolved, nothing is going to call the action later. The action is taken out
+    // of the control block first, running it may destroy this future and release the block
+    if (!attach(std::move(action))) {
+        unique_task<unit, Arg> ready = std::move(control_block_->then_action);
+        ready(control_block_->value);
+    }
+
+    return std::move(fut);
+}
+
+// Resolves once every future has resolved
+inline future<unit> when_all(std::vector<future<unit>> futures)
+{
+    auto [fut, prom] = create_futue_promice_pair<unit>();
+
+    if (futures.empty()) {
+        prom.resolve(unit());
+        return std::move(fut);
+    }
+
+    auto remaining = std::make_shared<std::atomic<size_t>>(futures.size());
+    for (future<unit>& pending : futures) {
+        pending.then<unit>([remaining, prom](unit) mutable -> unit {
+            if (remaining->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                prom.resolve(unit());
+            }
+            return unit();
+        });
+    }
+
+    return std::move(fut);
+}
+
+// Resolves with the index of the first future to resolve, never if there are none
+inline future<u32> when_any(std::vector<future<unit>> futures)
+{
+    auto [fut, prom] = create_futue_promice_pair<u32>();
+
+    auto done = std::make_shared<std::atomic<bool>>(false);
+    for (u32 i = 0; i < futures.size(); ++i) {
+        futures[i].then<unit>([done, prom, i](unit) mutable -> unit {
+            if (!done->exchange(true, std::memory_order_acq_rel)) {
+                prom.resolve(i);
+            }
+            return unit();
+        });
+    }
+
     return std::move(fut);
 }
 
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace bh {
+
+// Lock-free multi producer, single consumer queue (Vyukov). push() is safe from
+// any thread, pop() only from the consumer. A push that is still in progress may
+// not be visible to pop() yet.
+template <typename T>
+class mpsc_queue {
+public:
+    mpsc_queue()
+        : head_(&stub_)
+        , tail_(&stub_)
+    {
+    }
+
+    ~mpsc_queue()
+    {
+        while (pop()) { }
+
+        if (tail_ != &stub_) {
+            delete tail_;
+        }
+    }
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue(mpsc_queue&&)      = delete;
+
+    void push(T value)
+    {
+        node* pushed = new node { .next = nullptr, .value = std::move(value) };
+
+        node* previous = head_.exchange(pushed, std::memory_order_acq_rel);
+        previous->next.store(pushed, std::memory_order_release);
+    }
+
+    std::optional<T> pop()
+    {
+        node* tail = tail_;
+        node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return std::nullopt;
+        }
+
+        // The popped node stays as the new stub until the next pop
+        std::optional<T> value = std::move(next->value);
+        next->value.reset();
+        tail_ = next;
+
+        if (tail != &stub_) {
+            delete tail;
+        }
+
+        return value;
+    }
+
+private:
+    struct node {
+        std::atomic<node*> next;
+        std::optional<T> value;
+    };
+
+    alignas(64) std::atomic<node*> head_;
+    alignas(64) node* tail_;
+    node stub_ { .next = nullptr, .value = std::nullopt };
+};
+
+}
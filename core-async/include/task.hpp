@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace bh {
 
@@ -9,4 +13,110 @@ class unit { };
 template <typename Ret, typename Arg>
 using task_t = std::function<Ret(Arg)>;
 
+// Move-only counterpart of task_t for queued tasks and continuations. Callables
+// up to inline_size bytes live in place, larger ones on the heap.
+template <typename Ret, typename Arg>
+class unique_task {
+public:
+    static constexpr size_t inline_size = 64;
+
+    unique_task() = default;
+
+    template <typename Task>
+        requires(!std::is_same_v<std::decay_t<Task>, unique_task>
+                 && std::is_invocable_r_v<Ret, std::decay_t<Task>&, Arg>)
+    unique_task(Task&& task)
+    {
+        using callable = std::decay_t<Task>;
+
+        if constexpr (fits_inline<callable>) {
+            new (storage_) callable(std::forward<Task>(task));
+            operations_ = &inline_operations<callable>;
+        } else {
+            *reinterpret_cast<callable**>(storage_) = new callable(std::forward<Task>(task));
+            operations_                             = &heap_operations<callable>;
+        }
+    }
+
+    unique_task(const unique_task&) = delete;
+
+    unique_task(unique_task&& other) noexcept
+    {
+        take(other);
+    }
+
+    unique_task& operator=(unique_task&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~unique_task()
+    {
+        reset();
+    }
+
+    Ret operator()(Arg arg)
+    {
+        return operations_->invoke(storage_, std::move(arg));
+    }
+
+    explicit operator bool() const
+    {
+        return operations_ != nullptr;
+    }
+
+    void reset()
+    {
+        if (operations_ != nullptr) {
+            operations_->destroy(storage_);
+            operations_ = nullptr;
+        }
+    }
+
+private:
+    struct operations {
+        Ret (*invoke)(void*, Arg);
+        // Moves the callable into uninitialized storage and destroys the source
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void*);
+    };
+
+    template <typename Callable>
+    static constexpr bool fits_inline = sizeof(Callable) <= inline_size
+        && alignof(Callable) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Callable>;
+
+    template <typename Callable>
+    static constexpr operations inline_operations {
+        [](void* storage, Arg arg) -> Ret { return (*static_cast<Callable*>(storage))(std::move(arg)); },
+        [](void* from, void* to) {
+            new (to) Callable(std::move(*static_cast<Callable*>(from)));
+            static_cast<Callable*>(from)->~Callable();
+        },
+        [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+    };
+
+    template <typename Callable>
+    static constexpr operations heap_operations {
+        [](void* storage, Arg arg) -> Ret { return (**static_cast<Callable**>(storage))(std::move(arg)); },
+        [](void* from, void* to) { *static_cast<Callable**>(to) = *static_cast<Callable**>(from); },
+        [](void* storage) { delete *static_cast<Callable**>(storage); },
+    };
+
+    void take(unique_task& other)
+    {
+        if (other.operations_ != nullptr) {
+            other.operations_->relocate(other.storage_, storage_);
+            operations_       = other.operations_;
+            other.operations_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) std::byte storage_[inline_size];
+    const operations* operations_ { nullptr };
+};
+
 };
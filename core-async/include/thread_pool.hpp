@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "future.hpp"
+#include "task.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+// Work-stealing executor for CPU heavy tasks. Every worker pops its own deque
+// from the back and steals from the front of the others when it runs dry.
+// Tasks posted from a worker stay on that worker's deque.
+class thread_pool {
+public:
+    explicit thread_pool(u32 threads = std::max(std::thread::hardware_concurrency(), 1u));
+
+    // Runs the tasks already posted, then joins the workers
+    ~thread_pool();
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool(thread_pool&&)      = delete;
+
+    // The future resolves on the worker thread, so are continuations attached to it
+    template <typename Ret, typename Task>
+    future<Ret> async(Task&& task)
+    {
+        auto [fut, prom] = create_futue_promice_pair<Ret>();
+        post([task = std::forward<Task>(task), prom = std::move(prom)](unit) mutable -> unit {
+            prom.resolve(task(unit()));
+            return unit();
+        });
+        return std::move(fut);
+    }
+
+    template <typename Task>
+    void post(Task&& task)
+    {
+        enqueue(unique_task<unit, unit>(std::forward<Task>(task)));
+    }
+
+    u32 size() const
+    {
+        return workers_.size();
+    }
+
+private:
+    struct worker {
+        std::mutex mutex;
+        std::deque<unique_task<unit, unit>> tasks;
+    };
+
+    void enqueue(unique_task<unit, unit> task);
+    bool try_pop(u32 index, unique_task<unit, unit>& task);
+    void run(u32 index);
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::jthread> threads_;
+    std::atomic<u32> next_worker_ { 0 };
+
+    // Tasks posted but not yet picked up, workers sleep while there are none
+    std::atomic<u32> queued_ { 0 };
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ { false };
+};
+
+}
@@ -0,0 +1,102 @@
+#include "thread_pool.hpp"
+
+namespace bh {
+
+namespace {
+
+    // Pool and worker index of the current thread, null outside of workers
+    thread_local thread_pool* t_current_pool = nullptr;
+    thread_local u32 t_current_worker        = 0;
+
+}
+
+thread_pool::thread_pool(u32 threads)
+{
+    threads = std::max(threads, 1u);
+
+    for (u32 i = 0; i < threads; ++i) {
+        workers_.push_back(std::make_unique<worker>());
+    }
+
+    for (u32 i = 0; i < threads; ++i) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+
+    threads_.clear();
+}
+
+void thread_pool::enqueue(unique_task<unit, unit> task)
+{
+    u32 index = t_current_pool == this ? t_current_worker
+                                       : next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+
+    {
+        std::lock_guard lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard lock(sleep_mutex_);
+        queued_.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake_.notify_one();
+}
+
+bool thread_pool::try_pop(u32 index, unique_task<unit, unit>& task)
+{
+    {
+        worker& own = *workers_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (u32 i = 1; i < workers_.size(); ++i) {
+        worker& victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void thread_pool::run(u32 index)
+{
+    t_current_pool   = this;
+    t_current_worker = index;
+
+    unique_task<unit, unit> task;
+
+    while (true) {
+        if (try_pop(index, task)) {
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            task(unit());
+            task.reset();
+            continue;
+        }
+
+        std::unique_lock lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return stop_ || queued_.load(std::memory_order_relaxed) > 0; });
+        if (stop_ && queued_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+    }
+}
+
+}
@@ -3,6 +3,7 @@
 #include "spdlog/spdlog.h"
 
 #define LOG_ERROR SPDLOG_ERROR
+#define LOG_WARN SPDLOG_WARN
 #define LOG_INFO SPDLOG_INFO
 #define LOG_DEBUG SPDLOG_DEBUG
 #define LOG_TRACE SPDLOG_TRACE
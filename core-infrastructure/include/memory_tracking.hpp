@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "types.hpp"
+
+namespace bh {
+
+// Current and peak bytes per subsystem, counted by tracking_allocator. Counters
+// are process wide, so on a cluster every rank reports its own.
+
+enum class memory_tag : u32 {
+    particles = 0,
+    tree      = 1,
+    solver    = 2,
+    transport = 3,
+};
+
+static constexpr u32 memory_tag_count = 4;
+
+const char* memory_tag_name(memory_tag tag) noexcept;
+
+struct memory_counter {
+    std::atomic<i64> current { 0 };
+    std::atomic<i64> peak { 0 };
+};
+
+inline static_array<memory_counter, memory_tag_count> g_memory_counters;
+
+inline void memory_allocated(memory_tag tag, size_t bytes) noexcept
+{
+    memory_counter& counter = g_memory_counters[std::to_underlying(tag)];
+
+    i64 current = counter.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    i64 peak    = counter.peak.load(std::memory_order_relaxed);
+    while (current > peak && !counter.peak.compare_exchange_weak(peak, current, std::memory_order_relaxed)) { }
+}
+
+inline void memory_deallocated(memory_tag tag, size_t bytes) noexcept
+{
+    g_memory_counters[std::to_underlying(tag)].current.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// One line with current and peak bytes of every subsystem
+std::string memory_report();
+
+template <typename T, memory_tag Tag>
+struct tracking_allocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = tracking_allocator<U, Tag>;
+    };
+
+    tracking_allocator() noexcept = default;
+
+    template <typename U>
+    tracking_allocator(const tracking_allocator<U, Tag>&) noexcept
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        T* result = static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t { alignof(T) }));
+        memory_allocated(Tag, count * sizeof(T));
+        return result;
+    }
+
+    void deallocate(T* pointer, size_t count) noexcept
+    {
+        memory_deallocated(Tag, count * sizeof(T));
+        ::operator delete(pointer, std::align_val_t { alignof(T) });
+    }
+
+    template <typename U>
+    friend bool operator==(const tracking_allocator&, const tracking_allocator<U, Tag>&) noexcept
+    {
+        return true;
+    }
+};
+
+template <typename T, memory_tag Tag>
+using tracked_array = std::vector<T, tracking_allocator<T, Tag>>;
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "types.hpp"
+
+namespace bh {
+
+// Hardware counters of the calling thread, read as one perf_event_open group and
+// accumulated per named phase. Without counter access (non-Linux, containers,
+// perf_event_paranoid) enabling fails and scopes stay no-ops.
+
+enum class perf_counter : u32 {
+    cycles           = 0,
+    instructions     = 1,
+    cache_references = 2,
+    cache_misses     = 3,
+    branches         = 4,
+    branch_misses    = 5,
+};
+
+static constexpr u32 perf_counter_count = 6;
+
+using perf_sample = static_array<u64, perf_counter_count>;
+
+inline std::atomic<bool> g_perf_counters_enabled { false };
+
+// Opens the counter group for the calling thread, returns false if counters are unavailable
+bool enable_perf_counters();
+
+inline bool perf_counters_enabled() noexcept
+{
+    return g_perf_counters_enabled.load(std::memory_order_relaxed);
+}
+
+perf_sample perf_counters_read() noexcept;
+
+// `phase` must outlive the report, pass string literals
+void perf_counters_record(const char* phase, const perf_sample& begin, const perf_sample& end);
+
+// One line per phase: calls, cycles, IPC, cache and branch miss rates
+std::string perf_counters_report();
+
+class perf_scope {
+public:
+    explicit perf_scope(const char* phase) noexcept
+        : phase_(perf_counters_enabled() ? phase : nullptr)
+    {
+        if (phase_) {
+            begin_ = perf_counters_read();
+        }
+    }
+
+    ~perf_scope()
+    {
+        if (phase_) {
+            perf_counters_record(phase_, begin_, perf_counters_read());
+        }
+    }
+
+    perf_scope(const perf_scope&) = delete;
+    perf_scope(perf_scope&&)      = delete;
+
+private:
+    const char* phase_;
+    perf_sample begin_ {};
+};
+
+}
+
+#define BH_PERF_CONCAT_IMPL(a, b) a##b
+#define BH_PERF_CONCAT(a, b) BH_PERF_CONCAT_IMPL(a, b)
+
+#define PERF_SCOPE(phase) ::bh::perf_scope BH_PERF_CONCAT(perf_scope_, __LINE__)(phase)
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "types.hpp"
+
+namespace bh {
+
+// Phase spans recorded into per-thread buffers and exported as a Chrome/Perfetto
+// JSON trace. When tracing is disabled a scope costs one relaxed atomic load.
+
+struct trace_event {
+    const char* name;
+    u64 begin_ns;
+    u64 duration_ns;
+};
+
+inline std::atomic<bool> g_tracing_enabled { false };
+
+void enable_tracing(u32 process_id, std::string process_name);
+
+inline bool tracing_enabled() noexcept
+{
+    return g_tracing_enabled.load(std::memory_order_relaxed);
+}
+
+u64 trace_clock_ns() noexcept;
+
+// `name` must outlive the trace, pass string literals
+void trace_record(const char* name, u64 begin_ns, u64 end_ns);
+
+// Comma separated Chrome trace events of all threads of this process
+std::string trace_events_json();
+
+// Writes a complete trace from the event fragments of several processes
+void write_chrome_trace(const std::string& path, const array<std::string>& fragments);
+
+class trace_scope {
+public:
+    explicit trace_scope(const char* name) noexcept
+        : name_(tracing_enabled() ? name : nullptr)
+        , begin_ns_(name_ ? trace_clock_ns() : 0)
+    {
+    }
+
+    ~trace_scope()
+    {
+        if (name_) {
+            trace_record(name_, begin_ns_, trace_clock_ns());
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope(trace_scope&&)      = delete;
+
+private:
+    const char* name_;
+    u64 begin_ns_;
+};
+
+}
+
+#define BH_TRACE_CONCAT_IMPL(a, b) a##b
+#define BH_TRACE_CONCAT(a, b) BH_TRACE_CONCAT_IMPL(a, b)
+
+#define TRACE_SCOPE(name) ::bh::trace_scope BH_TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -0,0 +1,52 @@
+#include "memory_tracking.hpp"
+
+#include <utility>
+
+#include "fmt/format.h"
+
+namespace bh {
+
+const char* memory_tag_name(memory_tag tag) noexcept
+{
+    switch (tag) {
+    case memory_tag::particles:
+        return "particles";
+    case memory_tag::tree:
+        return "tree";
+    case memory_tag::solver:
+        return "solver";
+    case memory_tag::transport:
+        return "transport";
+    }
+    return "unknown";
+}
+
+std::string memory_report()
+{
+    auto kibibytes = [](i64 bytes) -> double { return bytes / 1024.0; };
+
+    std::string result;
+    i64 total_current = 0;
+    i64 total_peak    = 0;
+
+    for (u32 tag = 0; tag < memory_tag_count; ++tag) {
+        i64 current = g_memory_counters[tag].current.load(std::memory_order_relaxed);
+        i64 peak    = g_memory_counters[tag].peak.load(std::memory_order_relaxed);
+
+        total_current += current;
+        total_peak += peak;
+
+        result += fmt::format(
+            "{}={:.1f}KiB (peak {:.1f}KiB), ",
+            memory_tag_name(static_cast<memory_tag>(tag)),
+            kibibytes(current),
+            kibibytes(peak));
+    }
+
+    // Sum of per subsystem peaks, an upper bound of the real peak
+    result += fmt::format("total={:.1f}KiB (peak <= {:.1f}KiB)", kibibytes(total_current), kibibytes(total_peak));
+
+    return result;
+}
+
+}
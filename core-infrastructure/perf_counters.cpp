@@ -0,0 +1,172 @@
+#include "perf_counters.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <utility>
+
+#include "fmt/format.h"
+
+#include "logging.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bh {
+
+namespace {
+
+    struct phase_counters {
+        std::string_view phase;
+        u64 calls;
+        perf_sample values;
+    };
+
+    array<phase_counters> g_phases;
+
+#ifdef __linux__
+    int g_group_fd = -1;
+
+    int open_counter(u32 type, u64 config, int group_fd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+
+        attr.size           = sizeof(attr);
+        attr.type           = type;
+        attr.config         = config;
+        attr.disabled       = group_fd == -1 ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+#endif
+
+}
+
+bool enable_perf_counters()
+{
+#ifdef __linux__
+    static constexpr std::pair<u32, u64> events[perf_counter_count] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+
+    if (g_group_fd != -1) {
+        return true;
+    }
+
+    array<int> fds;
+    for (auto [type, config] : events) {
+        int fd = open_counter(type, config, fds.empty() ? -1 : fds.front());
+        if (fd == -1) {
+            LOG_INFO(fmt::format("Hardware performance counters unavailable: {}", std::strerror(errno)));
+            for (int opened : fds) {
+                close(opened);
+            }
+            return false;
+        }
+        fds.push_back(fd);
+    }
+
+    g_group_fd = fds.front();
+    ioctl(g_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(g_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    g_perf_counters_enabled.store(true, std::memory_order_relaxed);
+    return true;
+#else
+    LOG_INFO("Hardware performance counters are only supported on Linux");
+    return false;
+#endif
+}
+
+perf_sample perf_counters_read() noexcept
+{
+    perf_sample sample {};
+
+#ifdef __linux__
+    struct {
+        u64 count;
+        u64 time_enabled;
+        u64 time_running;
+        u64 values[perf_counter_count];
+    } data;
+
+    if (read(g_group_fd, &data, sizeof(data)) != sizeof(data)) {
+        return sample;
+    }
+
+    // Scale up if the kernel had to multiplex the group
+    double scale = data.time_running == 0 ? 0.0 : static_cast<double>(data.time_enabled) / data.time_running;
+    for (u32 i = 0; i < perf_counter_count; ++i) {
+        sample[i] = static_cast<u64>(data.values[i] * scale);
+    }
+#endif
+
+    return sample;
+}
+
+void perf_counters_record(const char* phase, const perf_sample& begin, const perf_sample& end)
+{
+    // By content, the same name at two sites is one phase
+    std::string_view name = phase;
+    auto it               = std::find_if(
+        g_phases.begin(), g_phases.end(), [name](const phase_counters& counters) { return counters.phase == name; });
+
+    if (it == g_phases.end()) {
+        g_phases.push_back(phase_counters { .phase = name, .calls = 0, .values = {} });
+        it = std::prev(g_phases.end());
+    }
+
+    ++it->calls;
+    for (u32 i = 0; i < perf_counter_count; ++i) {
+        it->values[i] += end[i] - begin[i];
+    }
+}
+
+std::string perf_counters_report()
+{
+    auto ratio = [](u64 a, u64 b) -> double { return b == 0 ? 0.0 : static_cast<double>(a) / b; };
+
+    std::string result;
+
+    for (const phase_counters& counters : g_phases) {
+        const perf_sample& v = counters.values;
+
+        u64 cycles        = v[std::to_underlying(perf_counter::cycles)];
+        u64 instructions  = v[std::to_underlying(perf_counter::instructions)];
+        u64 references    = v[std::to_underlying(perf_counter::cache_references)];
+        u64 cache_misses  = v[std::to_underlying(perf_counter::cache_misses)];
+        u64 branches      = v[std::to_underlying(perf_counter::branches)];
+        u64 branch_misses = v[std::to_underlying(perf_counter::branch_misses)];
+
+        result += fmt::format(
+            "{}{}: calls={}, cycles={}, instructions={}, ipc={:.2f}, cache_miss_rate={:.2f}%, "
+            "branch_miss_rate={:.2f}%",
+            result.empty() ? "" : "\n",
+            counters.phase,
+            counters.calls,
+            cycles,
+            instructions,
+            ratio(instructions, cycles),
+            100.0 * ratio(cache_misses, references),
+            100.0 * ratio(branch_misses, branches));
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,101 @@
+#include "tracing.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+#include "fmt/format.h"
+
+namespace bh {
+
+namespace {
+
+    struct thread_buffer {
+        u32 thread;
+        array<trace_event> events;
+    };
+
+    std::mutex g_buffers_mutex;
+    array<std::unique_ptr<thread_buffer>> g_buffers;
+
+    u32 g_process_id { 0 };
+    std::string g_process_name;
+
+    thread_local thread_buffer* t_buffer = nullptr;
+
+    // Registration takes the lock once per thread, recording itself never does
+    thread_buffer& current_buffer()
+    {
+        if (t_buffer == nullptr) {
+            std::lock_guard lock(g_buffers_mutex);
+
+            auto buffer = std::make_unique<thread_buffer>();
+            buffer->thread = g_buffers.size();
+            buffer->events.reserve(1 << 16);
+
+            t_buffer = buffer.get();
+            g_buffers.push_back(std::move(buffer));
+        }
+        return *t_buffer;
+    }
+
+}
+
+void enable_tracing(u32 process_id, std::string process_name)
+{
+    g_process_id   = process_id;
+    g_process_name = std::move(process_name);
+    g_tracing_enabled.store(true, std::memory_order_relaxed);
+}
+
+u64 trace_clock_ns() noexcept
+{
+    // Wall clock, so spans of different ranks line up in one trace
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+void trace_record(const char* name, u64 begin_ns, u64 end_ns)
+{
+    current_buffer().events.push_back(
+        trace_event { .name = name, .begin_ns = begin_ns, .duration_ns = end_ns - begin_ns });
+}
+
+std::string trace_events_json()
+{
+    std::lock_guard lock(g_buffers_mutex);
+
+    std::string result = fmt::format(
+        "{{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": {}, \"args\": {{\"name\": \"{}\"}}}}",
+        g_process_id,
+        g_process_name);
+
+    for (const auto& buffer : g_buffers) {
+        for (const trace_event& event : buffer->events) {
+            result += fmt::format(
+                ",\n{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+                event.name,
+                g_process_id,
+                buffer->thread,
+                event.begin_ns / 1000.0,
+                event.duration_ns / 1000.0);
+        }
+    }
+
+    return result;
+}
+
+void write_chrome_trace(const std::string& path, const array<std::string>& fragments)
+{
+    std::ofstream out(path);
+
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < fragments.size(); ++i) {
+        out << fragments[i] << (i + 1 == fragments.size() ? "\n" : ",\n");
+    }
+    out << "]}\n";
+}
+
+}
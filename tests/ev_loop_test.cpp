@@ -1,6 +1,16 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <thread>
 #include <gtest/gtest.h>
+#include <utility>
+#include <vector>
 
+#include "coroutine.hpp"
 #include "ev_loop.hpp"
+#include "mpsc_queue.hpp"
+#include "thread_pool.hpp"
 #include "types.hpp"
 
 namespace bh {
@@ -38,6 +48,295 @@ TEST(EvLoopTest, ThenTest)
     });
 }
 
+TEST(EvLoopTest, ThenAfterResolveTest)
+{
+    auto [fut, prom] = create_futue_promice_pair<u32>();
+    prom.resolve(42);
+
+    bool called          = false;
+    future<unit> chained = fut.then<unit>([&called](u32 res) -> unit {
+        EXPECT_EQ(42, res);
+        called = true;
+        return unit();
+    });
+
+    EXPECT_TRUE(called);
+    EXPECT_TRUE(chained.resolved());
+}
+
+TEST(EvLoopTest, WhenAllTest)
+{
+    startEvLoop([](unit) -> unit {
+        std::vector<future<unit>> futures;
+        for (u32 i = 0; i < 3; ++i) {
+            futures.push_back(pushToEvLoop<unit>([](unit) -> unit { return unit(); }));
+        }
+
+        future<unit> all = when_all(std::move(futures)).then<unit>([](unit) -> unit {
+            stopEvLoop();
+            return unit();
+        });
+
+        EXPECT_FALSE(all.resolved());
+
+        return unit();
+    });
+
+    EXPECT_TRUE(when_all({}).resolved());
+}
+
+TEST(EvLoopTest, PostTest)
+{
+    u32 runs = 0;
+
+    startEvLoop([&runs](unit) -> unit {
+        postToEvLoop([&runs](unit) -> unit {
+            ++runs;
+            postToEvLoop([&runs](unit) -> unit {
+                ++runs;
+                return unit();
+            });
+            return unit();
+        });
+        return unit();
+    });
+
+    // Returns once the queue is drained
+    EXPECT_EQ(2, runs);
+}
+
+TEST(EvLoopTest, UniqueTaskTest)
+{
+    auto value = std::make_unique<u32>(41);
+    unique_task<u32, u32> small = [value = std::move(value)](u32 add) -> u32 { return *value + add; };
+
+    static_array<u64, 16> padding {};
+    padding[15] = 2;
+    unique_task<u32, u32> large = [padding](u32 add) -> u32 { return padding[15] + add; };
+
+    unique_task<u32, u32> moved = std::move(small);
+    EXPECT_FALSE(small);
+    EXPECT_EQ(42, moved(1));
+
+    moved = std::move(large);
+    EXPECT_EQ(3, moved(1));
+}
+
+// Completes after a number of polls, like a request in flight
+class countdown_source : public event_source {
+public:
+    explicit countdown_source(u32 polls)
+        : polls_(polls)
+    {
+        g_event_loop.add_source(this);
+    }
+
+    ~countdown_source() override
+    {
+        g_event_loop.remove_source(this);
+    }
+
+    bool progress() override
+    {
+        if (polls_ == 0 || --polls_ > 0) {
+            return false;
+        }
+
+        pair_.second.resolve(unit());
+        return true;
+    }
+
+    bool waiting() const override
+    {
+        return polls_ > 0;
+    }
+
+    future<unit>& done()
+    {
+        return pair_.first;
+    }
+
+private:
+    u32 polls_;
+    std::pair<future<unit>, promice<unit>> pair_ { create_futue_promice_pair<unit>() };
+};
+
+TEST(EvLoopTest, EventSourceTest)
+{
+    g_event_loop.set_idle_policy(
+        idle_policy { .spin_rounds = 2, .yield_rounds = 2, .max_sleep = std::chrono::microseconds(100) });
+
+    countdown_source source(10);
+    bool completed = false;
+
+    // No stop, the loop runs while the source is waiting
+    startEvLoop([&source, &completed](unit) -> unit {
+        future<unit> fut = source.done().then<unit>([&completed](unit) -> unit {
+            completed = true;
+            return unit();
+        });
+        return unit();
+    });
+
+    EXPECT_TRUE(completed);
+    EXPECT_FALSE(source.waiting());
+
+    g_event_loop.set_idle_policy(idle_policy {});
+}
+
+TEST(EvLoopTest, WhenAnyTest)
+{
+    auto [first, first_prom]   = create_futue_promice_pair<unit>();
+    auto [second, second_prom] = create_futue_promice_pair<unit>();
+
+    std::vector<future<unit>> futures;
+    futures.push_back(std::move(first));
+    futures.push_back(std::move(second));
+
+    future<u32> any = when_any(std::move(futures));
+    EXPECT_FALSE(any.resolved());
+
+    second_prom.resolve(unit());
+    first_prom.resolve(unit());
+
+    EXPECT_TRUE(any.resolved());
+    EXPECT_EQ(1, any.get());
+}
+
+TEST(EvLoopTest, MpscQueueTest)
+{
+    constexpr u32 producers = 4;
+    constexpr u32 pushes    = 10000;
+
+    mpsc_queue<std::pair<u32, u32>> queue;
+
+    std::vector<std::jthread> threads;
+    for (u32 producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&queue, producer] {
+            for (u32 i = 0; i < pushes; ++i) {
+                queue.push({ producer, i });
+            }
+        });
+    }
+
+    // Order is kept per producer
+    static_array<u32, producers> next {};
+    u32 popped = 0;
+    while (popped < producers * pushes) {
+        if (std::optional<std::pair<u32, u32>> value = queue.pop()) {
+            EXPECT_EQ(next[value->first]++, value->second);
+            ++popped;
+        }
+    }
+
+    EXPECT_FALSE(queue.pop());
+}
+
+TEST(EvLoopTest, ThreadPoolTest)
+{
+    thread_pool pool(4);
+
+    std::atomic<u32> sum { 0 };
+    std::vector<future<unit>> futures;
+    for (u32 i = 1; i <= 100; ++i) {
+        futures.push_back(pool.async<unit>([&sum, i](unit) -> unit {
+            sum.fetch_add(i);
+            return unit();
+        }));
+    }
+
+    std::atomic<bool> done { false };
+    future<unit> all = when_all(std::move(futures)).then<unit>([&done](unit) -> unit {
+        done = true;
+        return unit();
+    });
+
+    while (!done) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(5050, sum.load());
+}
+
+TEST(EvLoopTest, OffloadTest)
+{
+    thread_pool pool(2);
+    std::thread::id loop_thread = std::this_thread::get_id();
+    u32 result                  = 0;
+
+    // No stop, the loop waits for the offloaded task
+    startEvLoop([&](unit) -> unit {
+        future<unit> fut = g_event_loop
+                               .offload<u32>(pool,
+                                             [loop_thread](unit) -> u32 {
+                                                 EXPECT_NE(loop_thread, std::this_thread::get_id());
+                                                 return 42;
+                                             })
+                               .then<unit>([&result, loop_thread](u32 value) -> unit {
+                                   EXPECT_EQ(loop_thread, std::this_thread::get_id());
+                                   result = value;
+                                   return unit();
+                               });
+        return unit();
+    });
+
+    EXPECT_EQ(42, result);
+}
+
+future<u32> add_later(future<u32> first, future<u32> second)
+{
+    u32 sum = co_await std::move(first);
+    co_await reschedule();
+    sum += co_await std::move(second);
+    co_return sum;
+}
+
+TEST(EvLoopTest, CoroutineTest)
+{
+    auto [first, first_prom]   = create_futue_promice_pair<u32>();
+    auto [second, second_prom] = create_futue_promice_pair<u32>();
+    u32 result                 = 0;
+
+    startEvLoop([&](unit) -> unit {
+        future<unit> fut = add_later(std::move(first), std::move(second)).then<unit>([&result](u32 sum) -> unit {
+            result = sum;
+            return unit();
+        });
+
+        // The coroutine waits for the first value
+        EXPECT_EQ(0, result);
+        first_prom.resolve(40);
+        // Already resolved, co_await does not suspend
+        second_prom.resolve(2);
+        return unit();
+    });
+
+    EXPECT_EQ(42, result);
+}
+
+future<u32> pass_on(future<u32> fut)
+{
+    co_return co_await std::move(fut);
+}
+
+TEST(EvLoopTest, CoroutineResolvedElsewhereTest)
+{
+    // The value may land before, during or after the coroutine suspends. If the
+    // coroutine is waiting by then, it finishes on the resolving thread
+    for (u32 i = 0; i < 1000; ++i) {
+        auto [fut, prom]        = create_futue_promice_pair<u32>();
+        std::atomic<u32> result = 0;
+        std::thread resolver([prom = std::move(prom), i]() mutable { prom.resolve(i + 1); });
+
+        future<unit> done = pass_on(std::move(fut)).then<unit>([&result](u32 value) -> unit {
+            result = value;
+            return unit();
+        });
+
+        resolver.join();
+        EXPECT_EQ(i + 1, result.load());
+    }
+}
+
 void count(int counter)
 {
     if (counter == 0) {
@@ -1,8 +1,12 @@
+#include <cstddef>
 #include <cstdlib>
 #include <gtest/gtest.h>
+#include <span>
+#include <utility>
 #include <vector>
 
 #include "linalg.hpp"
+#include "memory_tracking.hpp"
 #include "tree.hpp"
 #include "types.hpp"
 
@@ -167,6 +171,63 @@ TEST(QuadTreeTest, WalkNodesTestBalance)
     EXPECT_EQ(tree.get_node(2).sum, 2);
 }
 
+TEST(QuadTreeTest, ForEachNodeTest)
+{
+    std::vector<point> data = { point { .position = vec2 { -1.0f, -1.0f }, .amout = 1 },
+                                point { .position = vec2 { -1.0f, 1.0f }, .amout = 1 },
+                                point { .position = vec2 { 1.0f, -1.0f }, .amout = 1 } };
+
+    test_quadtree tree = test_quadtree::build(data);
+
+    EXPECT_EQ(tree.node_count(), 3 + 1);
+
+    tree.for_each_node([](node& n) { n.sum += 1; });
+
+    for (u32 i = 0; i < tree.node_count(); ++i) {
+        EXPECT_EQ(tree.get_node(i).sum, 1);
+    }
+}
+
+TEST(QuadTreeTest, ShapeTest)
+{
+    std::vector<point> data = { point { .position = vec2 { -1.0f, -1.0f } },
+                                point { .position = vec2 { -1.0f, -1.0f } },
+                                point { .position = vec2 { 1.0f, -1.0f } },
+                                point { .position = vec2 { 1.0f, 1.0f } } };
+
+    test_quadtree tree = test_quadtree::build(data);
+
+    EXPECT_EQ(tree.node_count(), 3 + 1);
+
+    array<u32> depth_histogram(4);
+    array<u32> leaf_occupancy(4);
+
+    tree.shape(depth_histogram, leaf_occupancy);
+
+    EXPECT_EQ(depth_histogram, (array<u32> { 1, 3, 0, 0 }));
+    EXPECT_EQ(leaf_occupancy, (array<u32> { 0, 2, 1, 0 }));
+}
+
+TEST(QuadTreeTest, MemoryTrackingTest)
+{
+    std::vector<point> data = { point { .position = vec2 { -1.0f, -1.0f } },
+                                point { .position = vec2 { -1.0f, 1.0f } },
+                                point { .position = vec2 { 1.0f, -1.0f } },
+                                point { .position = vec2 { 1.0f, 1.0f } } };
+
+    const memory_counter& counter = g_memory_counters[std::to_underlying(memory_tag::tree)];
+    i64 before                    = counter.current.load();
+
+    {
+        test_quadtree tree = test_quadtree::build(data);
+
+        EXPECT_GE(counter.current.load() - before, tree.node_count() * sizeof(node));
+        EXPECT_GE(counter.peak.load(), counter.current.load());
+    }
+
+    EXPECT_EQ(counter.current.load(), before);
+}
+
 TEST(QuadTreeTest, ReduceTest)
 {
     std::vector<point> data = { point { .position = vec2 { -1.0f, -1.0f }, .amout = 1 },
@@ -206,6 +267,95 @@ TEST(QuadTreeTest, ReduceTest)
     EXPECT_EQ(combined_sum, 4);
 }
 
+// Regions keep their points, in whatever order they are built
+TEST(QuadTreeTest, RegionTest)
+{
+    std::vector<point> data;
+    for (u32 i = 0; i < 10; ++i) {
+        data.push_back(point { .position = vec2 { (i * 7 % 10) * 1.0f, (i * 3 % 10) * 1.0f }, .amout = i + 1 });
+    }
+    std::vector<point> same_data = data;
+
+    test_quadtree tree      = test_quadtree::build(data);
+    test_quadtree same_tree = test_quadtree::build(same_data);
+
+    // Five regions, more than a top node takes
+    for (u32 region : { 3u, 0u, 4u, 1u, 2u }) {
+        tree.build_region(region, region * 2, region * 2 + 2);
+    }
+    tree.join_regions();
+
+    for (u32 region = 0; region < 5; ++region) {
+        same_tree.build_region(region, region * 2, region * 2 + 2);
+    }
+    same_tree.join_regions();
+
+    EXPECT_EQ(tree.node_count(), same_tree.node_count());
+    for (u32 i = 0; i < data.size(); ++i) {
+        EXPECT_EQ(data[i].amout, same_data[i].amout);
+    }
+
+    tree.walk_leafs([](node& n, point& p) { n.sum += p.amout; });
+
+    tree.walk_nodes([](node& n, node& c) { n.sum += c.sum; });
+
+    u32 points_sum = 0;
+
+    tree.reduce(
+        []([[maybe_unused]] const node& node) { return; },
+        [&points_sum](const point& point) { points_sum += point.amout; },
+        []([[maybe_unused]] const test_quadtree::axis_aligned_bounding_box aabb) -> bool { return false; });
+
+    EXPECT_EQ(tree.get_node(0).sum, 55);
+    EXPECT_EQ(points_sum, 55);
+    EXPECT_GE(tree.region_overlap(), 0.0);
+}
+
+TEST(QuadTreeTest, PublishAttachTest)
+{
+    std::vector<point> data = { point { .position = vec2 { -1.0f, -1.0f }, .amout = 1 },
+                                point { .position = vec2 { -1.0f, 1.0f }, .amout = 2 },
+                                point { .position = vec2 { 1.0f, -1.0f }, .amout = 3 },
+                                point { .position = vec2 { 1.0f, 1.0f }, .amout = 4 },
+                                point { .position = vec2 { 0.5f, 0.5f }, .amout = 5 } };
+
+    test_quadtree tree = test_quadtree::build(data);
+
+    tree.walk_leafs([](node& n, point& p) { n.sum += p.amout; });
+
+    tree.walk_nodes([](node& n, node& c) { n.sum += c.sum; });
+
+    std::vector<std::byte> small(test_quadtree::shared_bytes(tree.node_count()) - 1);
+    EXPECT_FALSE(tree.publish(small));
+    EXPECT_EQ(test_quadtree::published_bytes(small), test_quadtree::shared_bytes(tree.node_count()));
+
+    // 8 byte aligned, like shared memory would be
+    std::vector<u64> memory(test_quadtree::shared_bytes(tree.node_count()) / sizeof(u64) + 1);
+    std::span<std::byte> bytes = std::as_writable_bytes(std::span(memory));
+    EXPECT_TRUE(tree.publish(bytes));
+
+    test_quadtree attached = test_quadtree::attach(data, bytes);
+
+    EXPECT_EQ(attached.node_count(), tree.node_count());
+    EXPECT_EQ(attached.depth(), tree.depth());
+
+    u32 points_sum = 0;
+    u32 nodes_sum  = 0;
+
+    attached.reduce(
+        [&nodes_sum](const node& node) { nodes_sum += node.sum; },
+        []([[maybe_unused]] const point& point) { return; },
+        []([[maybe_unused]] const test_quadtree::axis_aligned_bounding_box aabb) -> bool { return true; });
+
+    attached.reduce(
+        []([[maybe_unused]] const node& node) { return; },
+        [&points_sum](const point& point) { points_sum += point.amout; },
+        []([[maybe_unused]] const test_quadtree::axis_aligned_bounding_box aabb) -> bool { return false; });
+
+    EXPECT_EQ(nodes_sum, 15);
+    EXPECT_EQ(points_sum, 15);
+}
+
 }
 
 int main(int argc, char** argv)
@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include "direct.hpp"
+#include "generator.hpp"
+#include "linalg.hpp"
+#include "model.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+TEST(SolverTest, DirectSummationTest)
+{
+    // Not a multiple of the tile size on purpose
+    particle_array points = generator { generator_params { .count = 1337, .scale_factor = 0.589_r } }.generate();
+    points.push_back(points.front());
+
+    const real epsilon = 1e-4_r;
+
+    for (u32 threads : { 1u, 3u }) {
+        direct_summation direct(epsilon, threads);
+
+        array<vec2> result;
+        direct.accelerations(points, 100, points.size(), result);
+
+        ASSERT_EQ(result.size(), points.size() - 100);
+
+        for (u32 i = 100; i < points.size(); ++i) {
+            vec2 expected { 0.0_r, 0.0_r };
+
+            for (u32 j = 0; j < points.size(); ++j) {
+                if (points[i].position == points[j].position) {
+                    continue;
+                }
+                expected = expected + compute_acceleration(points[i], points[j], epsilon);
+            }
+
+            EXPECT_LT((result[i - 100] - expected).len(), 1e-9 * expected.len());
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include "time_series.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+TEST(TimeSeriesTest, EmptyTest)
+{
+    time_series<4> series;
+
+    EXPECT_TRUE(series.empty());
+    EXPECT_EQ(series.size(), 0);
+    EXPECT_EQ(series.samples(), 0);
+}
+
+TEST(TimeSeriesTest, FullResolutionTest)
+{
+    time_series<4> series;
+
+    series.push(3.0_r);
+    series.push(1.0_r);
+    series.push(2.0_r);
+
+    EXPECT_EQ(series.size(), 3);
+    EXPECT_EQ(series.stride(), 1);
+    EXPECT_EQ(series[1].mean(), 1.0_r);
+    EXPECT_EQ(series.min(), 1.0_r);
+    EXPECT_EQ(series.max(), 3.0_r);
+    EXPECT_EQ(series.last(), 2.0_r);
+}
+
+TEST(TimeSeriesTest, DecimationTest)
+{
+    time_series<4> series;
+
+    for (u32 i = 0; i < 5; ++i) {
+        series.push(i);
+    }
+
+    // [0 1] [2 3] [4]
+    EXPECT_EQ(series.size(), 3);
+    EXPECT_EQ(series.stride(), 2);
+    EXPECT_EQ(series[0].min, 0.0_r);
+    EXPECT_EQ(series[0].max, 1.0_r);
+    EXPECT_EQ(series[1].mean(), 2.5_r);
+    EXPECT_EQ(series[2].count, 1);
+}
+
+TEST(TimeSeriesTest, BoundedTest)
+{
+    time_series<16> series;
+
+    real sum = 0.0_r;
+    for (u32 i = 0; i < 100000; ++i) {
+        real value = (i % 1000 == 0) ? -1.0_r * i : 1.0_r * i;
+        series.push(value);
+        sum += value;
+    }
+
+    EXPECT_LE(series.size(), 16);
+    EXPECT_EQ(series.samples(), 100000);
+    EXPECT_EQ(series.min(), -99000.0_r);
+    EXPECT_EQ(series.max(), 99999.0_r);
+
+    real bucket_sum = 0.0_r;
+    real bucket_min = series[0].min;
+    u64 count       = 0;
+    for (u32 i = 0; i < series.size(); ++i) {
+        bucket_sum += series[i].sum;
+        bucket_min = std::min(bucket_min, series[i].min);
+        count += series[i].count;
+    }
+
+    EXPECT_EQ(count, 100000);
+    EXPECT_DOUBLE_EQ(bucket_sum, sum);
+    EXPECT_EQ(bucket_min, series.min());
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "chunks.hpp"
+#include "cluster.hpp"
+#include "ev_loop.hpp"
+#include "transport.hpp"
+#include "transport_backend.hpp"
+#include "types.hpp"
+
+namespace bh {
+
+namespace {
+
+    constexpr u32 payload_id = 7;
+    constexpr u32 echo_id    = 8;
+    constexpr u32 result_id  = 9;
+
+    array<u32> make_payload(u32 size, u32 seed)
+    {
+        array<u32> payload(size);
+        std::iota(payload.begin(), payload.end(), seed);
+        return payload;
+    }
+
+    enum class test_message_type : u32 {
+        value = 1,
+    };
+
+    struct value_message {
+        static constexpr test_message_type msg_type = test_message_type::value;
+        static constexpr bool zero_copy             = true;
+
+        u32 value;
+    };
+
+    using test_messages = message_registry<value_message>;
+
+    static_assert(test_messages::table_size == 2);
+
+}
+
+TEST(LocalBackendTest, ArrayRoundTripTest)
+{
+    array<std::unique_ptr<transport_backend>> backends = make_local_backends(2);
+
+    std::thread echo([backend = std::move(backends[1])]() mutable {
+        cluster_transport transport(std::move(backend));
+        array<u32> payload = transport.receive_array<u32>(0, payload_id);
+        transport.send_array<u32>(payload, 0, echo_id);
+    });
+
+    cluster_transport transport(std::move(backends[0]));
+    array<u32> payload = make_payload(1000, 3);
+    transport.send_array<u32>(payload, 1, payload_id);
+
+    EXPECT_EQ(transport.receive_array<u32>(1, echo_id), payload);
+    echo.join();
+}
+
+TEST(LocalBackendTest, AsyncArrayTest)
+{
+    array<std::unique_ptr<transport_backend>> backends = make_local_backends(2);
+
+    std::thread sender([backend = std::move(backends[1])]() mutable {
+        cluster_transport transport(std::move(backend));
+        transport.send_array<u32>(make_payload(100, 1), 0, payload_id);
+    });
+
+    cluster_transport transport(std::move(backends[0]));
+    array<u32> received(100);
+    bool done = false;
+
+    startEvLoop([&](unit) -> unit {
+        future<unit> fut = transport.receive_array_async<u32>(received.begin(), received.end(), 1, payload_id)
+                               .then<unit>([&done](unit) -> unit {
+                                   done = true;
+                                   stopEvLoop();
+                                   return unit();
+                               });
+        return unit();
+    });
+
+    EXPECT_TRUE(done);
+    EXPECT_EQ(received, make_payload(100, 1));
+    sender.join();
+}
+
+TEST(LocalBackendTest, AllgatherTest)
+{
+    constexpr u32 ranks = 4;
+    constexpr u32 jobs  = 10;
+
+    array<std::unique_ptr<transport_backend>> backends = make_local_backends(ranks);
+    array<chunk> chunks                                = make_chunks(jobs, ranks - 1);
+    array<array<u32>> results(ranks);
+
+    // Rank 0 stays out of the compute group, like the master
+    auto run = [&](u32 rank) {
+        cluster_transport transport(std::move(backends[rank]));
+        transport.create_compute_group(rank != 0);
+        if (rank == 0) {
+            return;
+        }
+
+        array<u32> data(jobs, 0);
+        for (u32 i = chunks[rank - 1].begin; i < chunks[rank - 1].end; ++i) {
+            data[i] = i * 10;
+        }
+        transport.allgather_array<u32>(data, chunks);
+        results[rank] = data;
+    };
+
+    array<std::thread> threads;
+    for (u32 rank = 1; rank < ranks; ++rank) {
+        threads.emplace_back(run, rank);
+    }
+    run(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (u32 rank = 1; rank < ranks; ++rank) {
+        for (u32 i = 0; i < jobs; ++i) {
+            EXPECT_EQ(results[rank][i], i * 10);
+        }
+    }
+}
+
+// Messages are dispatched in the order they arrived, also behind an array that waits
+// for a blocking receive
+TEST(LocalBackendTest, DispatchTest)
+{
+    array<std::unique_ptr<transport_backend>> backends = make_local_backends(2);
+    cluster_transport sender(std::move(backends[1]));
+    cluster_transport transport(std::move(backends[0]), test_messages::table_size);
+
+    array<u32> values;
+    size_t expected = 2;
+    transport.add_handler<value_message>(
+        1,
+        [&values, &expected](value_message msg) -> unit {
+            values.push_back(msg.value);
+            if (values.size() == expected) {
+                stopEvLoop();
+            }
+            return unit();
+        },
+        value_message {},
+        true);
+
+    sender.send_message<value_message>(0, value_message { .value = 1 });
+    sender.send_message<value_message>(0, value_message { .value = 2 });
+    startEvLoop([](unit) -> unit { return unit(); });
+
+    expected = 3;
+    sender.send_array<u32>(make_payload(10, 0), 0, payload_id);
+    sender.send_message<value_message>(0, value_message { .value = 3 });
+    startEvLoop([](unit) -> unit { return unit(); });
+
+    EXPECT_EQ(values, (array<u32> { 1, 2, 3 }));
+    EXPECT_EQ(transport.receive_array<u32>(1, payload_id), make_payload(10, 0));
+}
+
+// Batched messages reach handlers and blocking receives in the order they were posted
+TEST(LocalBackendTest, BatchTest)
+{
+    array<std::unique_ptr<transport_backend>> backends = make_local_backends(2);
+    cluster_transport sender(std::move(backends[1]));
+    cluster_transport transport(std::move(backends[0]), test_messages::table_size);
+
+    for (u32 value = 1; value <= 3; ++value) {
+        sender.post_message<value_message>(0, value_message { .value = value });
+    }
+    sender.flush();
+
+    array<u32> values;
+    startEvLoop([&](unit) -> unit {
+        for (u32 i = 0; i < 2; ++i) {
+            transport.add_handler<value_message>(
+                1,
+                [&values](value_message msg) -> unit {
+                    values.push_back(msg.value);
+                    if (values.size() == 2) {
+                        stopEvLoop();
+                    }
+                    return unit();
+                },
+                value_message {});
+        }
+        return unit();
+    });
+
+    // The third one waits unpacked, the next batch still on the wire
+    for (u32 value = 4; value <= 5; ++value) {
+        sender.post_message<value_message>(0, value_message { .value = value });
+    }
+    sender.flush();
+
+    for (u32 i = 0; i < 3; ++i) {
+        value_message msg {};
+        transport.receive_message<value_message>(1, msg);
+        values.push_back(msg.value);
+    }
+
+    EXPECT_EQ(values, (array<u32> { 1, 2, 3, 4, 5 }));
+}
+
+// Every slave is reached once, from the rank it reports to, and reports for the slaves below it
+TEST(NodeTest, GroupTreeTest)
+{
+    constexpr u32 ranks = 15;
+    constexpr u32 group = 3;
+    node_roles roles { .frontend = true, .group_size = group };
+
+    node master(0, ranks, roles);
+    array<u32> reached;
+    array<u32> pending = master.downstream_node_indexes();
+    u32 depth          = 0;
+
+    EXPECT_EQ(master.subtree_node_indexes(0), master.slaves_node_indexes());
+
+    while (!pending.empty()) {
+        EXPECT_LE(++depth, 3u);
+
+        array<u32> next;
+        for (u32 index : pending) {
+            node slave(index, ranks, roles);
+            array<u32> downstream = slave.downstream_node_indexes();
+            EXPECT_LE(downstream.size(), group);
+
+            array<u32> subtree { index };
+            for (u32 child : downstream) {
+                EXPECT_EQ(node(child, ranks, roles).upstream_node_index(), index);
+
+                array<u32> below = slave.subtree_node_indexes(child);
+                subtree.insert(subtree.end(), below.begin(), below.end());
+            }
+
+            array<u32> expected(subtree.size());
+            std::iota(expected.begin(), expected.end(), index);
+            EXPECT_EQ(subtree, expected);
+
+            reached.push_back(index);
+            next.insert(next.end(), downstream.begin(), downstream.end());
+        }
+        pending = next;
+    }
+
+    std::sort(reached.begin(), reached.end());
+    EXPECT_EQ(reached, master.slaves_node_indexes());
+
+    // Without a group size the master talks to every slave
+    node flat(0, ranks);
+    EXPECT_EQ(flat.downstream_node_indexes(), flat.slaves_node_indexes());
+    EXPECT_TRUE(node(5, ranks).downstream_node_indexes().empty());
+    EXPECT_EQ(node(5, ranks).upstream_node_index(), 0u);
+}
+
+// Arrays many times the ring size, so they are streamed in pieces
+TEST(ShmBackendTest, ExchangeTest)
+{
+    constexpr u32 ranks = 3;
+    constexpr u32 size  = 100000;
+
+    cluster_transport transport(launch_shm_backend(ranks, 4096));
+
+    if (transport.rank() != 0) {
+        array<u32> payload = transport.receive_array<u32>(0, payload_id);
+        transport.send_array<u32>(payload, 0, echo_id);
+        transport.send_array<u32>(make_payload(size, transport.rank()), 0, payload_id);
+
+        u8 ok = payload == make_payload(size, 0);
+        transport.send_array<u8>(array<u8> { ok }, 0, result_id);
+        _exit(0);
+    }
+
+    // Both children send at once, each of them blocked on a full ring
+    for (u32 node = 1; node < ranks; ++node) {
+        transport.send_array<u32>(make_payload(size, 0), node, payload_id);
+    }
+
+    array<array<u32>> received(ranks, array<u32>(size));
+    startEvLoop([&](unit) -> unit {
+        std::vector<future<unit>> futures;
+        for (u32 node = 1; node < ranks; ++node) {
+            futures.push_back(
+                transport.receive_array_async<u32>(received[node].begin(), received[node].end(), node, payload_id));
+        }
+
+        future<unit> all = when_all(std::move(futures)).then<unit>([](unit) -> unit {
+            stopEvLoop();
+            return unit();
+        });
+        return unit();
+    });
+
+    for (u32 node = 1; node < ranks; ++node) {
+        EXPECT_EQ(transport.receive_array<u32>(node, echo_id), make_payload(size, 0));
+        EXPECT_EQ(received[node], make_payload(size, node));
+        EXPECT_EQ(transport.receive_array<u8>(node, result_id), array<u8> { 1 });
+    }
+}
+
+// A rank that dies fails the receive waiting for it, the other children are stopped
+TEST(ShmBackendTest, FailedRankTest)
+{
+    cluster_transport transport(launch_shm_backend(3, 4096));
+
+    if (transport.rank() == 1) {
+        _exit(1);
+    }
+    if (transport.rank() == 2) {
+        transport.receive_array<u32>(0, payload_id);
+        _exit(0);
+    }
+
+    EXPECT_THROW(transport.receive_array<u32>(1, payload_id), std::runtime_error);
+}
+
+// Messages waiting in the ring are streamed straight into the receive buffers, one each
+TEST(ShmBackendTest, ConsecutiveMessagesTest)
+{
+    cluster_transport transport(launch_shm_backend(2, 1 << 16));
+
+    if (transport.rank() != 0) {
+        for (u32 seed = 0; seed < 3; ++seed) {
+            transport.send_array<u32>(make_payload(1000, seed), 0, payload_id);
+        }
+        _exit(0);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for (u32 seed = 0; seed < 3; ++seed) {
+        array<u32> received(1000);
+        transport.receive_array<u32>(received.begin(), received.end(), 1, payload_id);
+        EXPECT_EQ(received, make_payload(1000, seed));
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}